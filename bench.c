@@ -0,0 +1,517 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "map.c"
+
+#define STRIDE 24           /* bytes per key in a key pool */
+#define WORK 1000000        /* operations timed per size, small maps repeat */
+#define THETA 0.99          /* zipf skew, as in ycsb */
+
+/*********
+ * usage *
+ *********/
+
+static const char* usage =
+    "usage: bench [-m min] [-n max] [-s ops|hash|latency|all]\n"
+    "  ops      csv of ns/op and ops/s for each operation, key distribution and size\n"
+    "  hash     put/get time and probe sequence lengths of each hash function\n"
+    "  latency  worst single put while growing, with and without MAP_INCREMENTAL\n"
+    "sizes go from min to max by factors of 10, default 1000 to 1000000\n";
+
+/*********************************************************************
+ *                                                                   *
+ *                              timing                               *
+ *                                                                   *
+ *********************************************************************/
+
+/*******
+ * now *
+ *******/
+
+/* monotonic time in nanoseconds */
+
+static double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**********
+ * random *
+ **********/
+
+/* splitmix64, small and fast enough to not show up in timings */
+
+static uint64_t
+random64(uint64_t* state)
+{
+    uint64_t z;
+
+    z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/*********************************************************************
+ *                                                                   *
+ *                               keys                                *
+ *                                                                   *
+ *********************************************************************/
+
+/************
+ * keys_seq *
+ ************/
+
+/* similar, sequential keys like "user:000123" */
+
+static char**
+keys_seq(int n, const char* fmt)
+{
+    char** keys;
+
+    keys = malloc(n * sizeof(char*));
+
+    for (int i = 0; i < n; i++) {
+        char buf[32];
+
+        snprintf(buf, sizeof(buf), fmt, i);
+        keys[i] = strdup(buf);
+    }
+
+    return keys;
+}
+
+/*************
+ * keys_free *
+ *************/
+
+static void
+keys_free(char** keys, int n)
+{
+    for (int i = 0; i < n; i++)
+        free(keys[i]);
+
+    free(keys);
+}
+
+/*************
+ * keys_pool *
+ *************/
+
+/* 
+ * n keys, STRIDE bytes apart in one allocation.  sequential keys look like
+ * "user:000123", random ones are the hex of a 64 bit number.  salt keeps
+ * the keys of different pools apart.
+ */
+
+static char*
+keys_pool(long n, int sequential, uint64_t salt)
+{
+    uint64_t state;
+    char* pool;
+
+    pool = malloc(n * STRIDE);
+    state = salt;
+
+    for (long i = 0; i < n; i++) {
+        if (sequential)
+            snprintf(pool + i * STRIDE, STRIDE, "user:%06ld", i + salt * n);
+        else
+            snprintf(pool + i * STRIDE, STRIDE, "%llx", 
+                     (unsigned long long)random64(&state));
+    }
+
+    return pool;
+}
+
+/***********
+ * shuffle *
+ ***********/
+
+/* a random permutation of 0 .. n - 1 */
+
+static int*
+shuffle(long n, uint64_t* state)
+{
+    int* order;
+
+    order = malloc(n * sizeof(int));
+
+    for (long i = 0; i < n; i++)
+        order[i] = i;
+
+    for (long i = n - 1; i > 0; i--) {
+        long j = random64(state) % (i + 1);
+        int tmp = order[i];
+
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    return order;
+}
+
+/********
+ * zipf *
+ ********/
+
+/* 
+ * n draws of ranks 0 .. n - 1, rank r about (r + 1)^-THETA as likely, using 
+ * the method of gray et al, "quickly generating billion-record synthetic 
+ * databases", as ycsb does
+ */
+
+static int*
+zipf(long n, uint64_t* state)
+{
+    double zetan, zeta2, alpha, eta, u, uz;
+    int* order;
+
+    zetan = 0;
+    for (long i = 1; i <= n; i++)
+        zetan += 1 / pow(i, THETA);
+
+    zeta2 = 1 + 1 / pow(2, THETA);
+    alpha = 1 / (1 - THETA);
+    eta = (1 - pow(2.0 / n, 1 - THETA)) / (1 - zeta2 / zetan);
+
+    order = malloc(n * sizeof(int));
+
+    for (long i = 0; i < n; i++) {
+        u = (random64(state) >> 11) * 0x1p-53;
+        uz = u * zetan;
+
+        if (uz < 1)
+            order[i] = 0;
+        else if (uz < zeta2)
+            order[i] = 1;
+        else
+            order[i] = (long)(n * pow(eta * u - eta + 1, alpha)) % n;
+    }
+
+    return order;
+}
+
+/*********************************************************************
+ *                                                                   *
+ *                         operations bench                          *
+ *                                                                   *
+ *********************************************************************/
+
+/*********
+ * dists *
+ *********/
+
+enum { SEQ, UNIFORM, ZIPF, NDISTS };
+
+static const char* dists[] = { "seq", "uniform", "zipf" };
+
+/**********
+ * report *
+ **********/
+
+/* one csv row, ns is the total time of ops operations */
+
+static void
+report(const char* dist, const char* mode, long n, const char* op, double ns, double ops)
+{
+    printf("%s,%s,%ld,%s,%.2f,%.0f\n", dist, mode, n, op, ns / ops, ops / ns * 1e9);
+}
+
+/*********
+ * visit *
+ *********/
+
+static int
+visit(const char* key, uintptr_t* val, void* ctx)
+{
+    (void)key;
+    *(uintptr_t*)ctx += *val;
+    return 0;
+}
+
+/*************
+ * bench_ops *
+ *************/
+
+/* 
+ * times every operation on n keys of a distribution.  keys are put in pool
+ * order, hits and updates follow the distribution, deletes a shuffle.
+ * maps smaller than WORK are rebuilt and timed again until WORK ops are done.
+ */
+
+static void
+bench_ops(int dist, const char* mode, int flags, long n)
+{
+    enum { INSERT, HIT, MISS, UPDATE, ITERATE, FOREACH, RESIZE, DELETE, NOPS };
+    static const char* ops[] = { "insert", "hit", "miss", "update", "iterate", 
+                                 "foreach", "resize", "delete" };
+    struct hashmap* map;
+    char *keys, *absent;
+    int *access, *order;
+    double ns[NOPS] = { 0 };
+    double t;
+    uint64_t state;
+    const char* key;
+    size_t len;
+    uintptr_t *val, res, sum;
+    long reps, seen;
+
+    state = n;
+    res = 0;
+    keys = keys_pool(n, dist == SEQ, 0);
+    absent = keys_pool(n, dist == SEQ, 1);
+    access = dist == ZIPF ? zipf(n, &state) : shuffle(n, &state);
+    order = shuffle(n, &state);
+
+    reps = n < WORK ? WORK / n : 1;
+    sum = 0;
+
+    for (long r = 0; r < reps; r++) {
+        map = map_alloc_ex(8, 0, 0, flags);
+
+        t = now();
+        for (long i = 0; i < n; i++)
+            map_put(map, keys + i * STRIDE, i);
+        ns[INSERT] += now() - t;
+
+        t = now();
+        for (long i = 0; i < n; i++) {
+            map_get(map, keys + access[i] * STRIDE, &res);
+            sum += res;
+        }
+        ns[HIT] += now() - t;
+
+        t = now();
+        for (long i = 0; i < n; i++)
+            sum += map_get(map, absent + i * STRIDE, &res);
+        ns[MISS] += now() - t;
+
+        t = now();
+        for (long i = 0; i < n; i++)
+            map_put(map, keys + access[i] * STRIDE, i);
+        ns[UPDATE] += now() - t;
+
+        t = now();
+        seen = 0;
+        for (map_begin(map); !map_end(map); map_next(map)) {
+            map_cur_ref(map, &key, &len, &val);
+            seen += *val;
+        }
+        ns[ITERATE] += now() - t;
+        sum += seen;
+
+        t = now();
+        map_foreach(map, visit, &sum);
+        ns[FOREACH] += now() - t;
+
+        /* always past the current capacity, timed per entry moved */
+        t = now();
+        map_reserve(map, map->cap);
+        ns[RESIZE] += now() - t;
+
+        t = now();
+        for (long i = 0; i < n; i++)
+            map_del(map, keys + order[i] * STRIDE);
+        ns[DELETE] += now() - t;
+
+        map_free(map);
+    }
+
+    for (int op = 0; op < NOPS; op++)
+        report(dists[dist], mode, n, ops[op], ns[op], (double)n * reps);
+
+    /* keeps the lookups from being optimized away */
+    if (sum == 1)
+        fprintf(stderr, "\n");
+
+    free(keys);
+    free(absent);
+    free(access);
+    free(order);
+}
+
+/*********************************************************************
+ *                                                                   *
+ *                            hash bench                             *
+ *                                                                   *
+ *********************************************************************/
+
+/**************
+ * bench_hash *
+ **************/
+
+/* throughput and probe sequence length distribution of one hash */
+
+static void
+bench_hash(const char* name, uint64_t (*hash)(const void*, size_t), int flags,
+           char** keys, int n)
+{
+    struct hashmap* map;
+    int hist[5] = { 0 };
+    double t0, t1, t2;
+    uintptr_t res;
+
+    map = map_alloc_ex(n / 2 + 1, 0, hash, flags);
+
+    t0 = now();
+    for (int i = 0; i < n; i++)
+        map_put(map, keys[i], i);
+
+    t1 = now();
+    for (int i = 0; i < n; i++)
+        map_get(map, keys[i], &res);
+
+    t2 = now();
+
+    /* psl 0, 1, 2-3, 4-7, 8+ */
+    for (int i = 0; i < map->cap + PSL_MAX; i++) {
+        int psl;
+
+        if (map->psls[i] == 0)
+            continue;
+
+        psl = map->psls[i] - 1;
+        hist[psl == 0 ? 0 : psl == 1 ? 1 : psl < 4 ? 2 : psl < 8 ? 3 : 4]++;
+    }
+
+    printf("%-12s %9d %8.1f %8.1f %8.3f %6d %7.1f%% %5.1f%% %5.1f%% %5.1f%% %5.1f%%\n",
+           name, n, (t1 - t0) / n, (t2 - t1) / n,
+           (double)map->cost / map->len, map->maxpsl,
+           100.0 * hist[0] / n, 100.0 * hist[1] / n, 100.0 * hist[2] / n,
+           100.0 * hist[3] / n, 100.0 * hist[4] / n);
+
+    map_free(map);
+}
+
+/*********************************************************************
+ *                                                                   *
+ *                          latency bench                            *
+ *                                                                   *
+ *********************************************************************/
+
+/*****************
+ * bench_latency *
+ *****************/
+
+/* worst single put while growing from empty, with and without MAP_INCREMENTAL */
+
+static void
+bench_latency(const char* name, int flags, char** keys, int n)
+{
+    struct hashmap* map;
+    double t0, t1, worst, total;
+
+    map = map_alloc_ex(8, 0, 0, flags);
+    worst = 0;
+    total = 0;
+
+    for (int i = 0; i < n; i++) {
+        t0 = now();
+        map_put(map, keys[i], i);
+        t1 = now();
+
+        total += t1 - t0;
+        if (t1 - t0 > worst)
+            worst = t1 - t0;
+    }
+
+    printf("%-12s %9d %8.1f %12.0f\n", name, n, total / n, worst);
+
+    map_free(map);
+}
+
+/*********************************************************************
+ *                                                                   *
+ *                              main                                 *
+ *                                                                   *
+ *********************************************************************/
+
+/********
+ * main *
+ ********/
+
+int
+main(int argc, char** argv)
+{
+    static const char* fmts[] = { "user:%06d", "%d" };
+    const char* suite;
+    long min, max;
+
+    min = 1000;
+    max = 1000000;
+    suite = "ops";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            min = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            max = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            suite = argv[++i];
+        } else {
+            fputs(usage, stderr);
+            return 1;
+        }
+    }
+
+    if (min < 1 || max > INT32_MAX / 2) {
+        fputs(usage, stderr);
+        return 1;
+    }
+
+    if (strcmp(suite, "ops") == 0 || strcmp(suite, "all") == 0) {
+        printf("dist,mode,n,op,ns_per_op,ops_per_s\n");
+
+        for (long n = min; n <= max; n *= 10) {
+            for (int d = 0; d < NDISTS; d++) {
+                bench_ops(d, "prime", 0, n);
+                bench_ops(d, "pow2", MAP_POW2, n);
+            }
+            fflush(stdout);
+        }
+    }
+
+    if (strcmp(suite, "hash") == 0 || strcmp(suite, "all") == 0) {
+        for (int f = 0; f < 2; f++) {
+            printf("\nkeys \"%s\"\n", fmts[f]);
+            printf("%-12s %9s %8s %8s %8s %6s %8s %6s %6s %6s %6s\n",
+                   "hash", "n", "put ns", "get ns", "mean psl", "max",
+                   "psl 0", "1", "2-3", "4-7", "8+");
+
+            for (long n = min; n <= max; n *= 10) {
+                char** keys;
+
+                keys = keys_seq(n, fmts[f]);
+                bench_hash("djb2", map_hash_djb2, 0, keys, n);
+                bench_hash("wyhash", map_hash_wyhash, 0, keys, n);
+                bench_hash("djb2/pow2", map_hash_djb2, MAP_POW2, keys, n);
+                bench_hash("wyhash/pow2", map_hash_wyhash, MAP_POW2, keys, n);
+                keys_free(keys, n);
+            }
+        }
+    }
+
+    if (strcmp(suite, "latency") == 0 || strcmp(suite, "all") == 0) {
+        printf("\nput latency\n");
+        printf("%-12s %9s %8s %12s\n", "mode", "n", "mean ns", "worst ns");
+
+        for (long n = min; n <= max; n *= 10) {
+            char** keys;
+
+            keys = keys_seq(n, fmts[0]);
+            bench_latency("resize", 0, keys, n);
+            bench_latency("incremental", MAP_INCREMENTAL, keys, n);
+            keys_free(keys, n);
+        }
+    }
+
+    return 0;
+}
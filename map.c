@@ -2,18 +2,102 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "map.h"
 
 #define BASE_PRIME 5381
+#define PSL_MAX 127         /* longest probe sequence before the map grows */
+#define MIGRATE_STEP 16     /* old slots moved per operation during an incremental rehash */
+#define BATCH 32            /* keys hashed and prefetched ahead of their probes */
+
+#if defined(__AVX2__)
+#define GROUP 32            /* control bytes compared at once */
+#elif defined(__SSE2__)
+#define GROUP 16
+#else
+#define GROUP 8
+#endif
+
+#define TAG(h) (0x80 | ((h) & 0x7f))    /* occupied bit and 7 bit fingerprint */
+#define WORDS(n) (((n) + 63) / 64)        /* bitmap words for n slots */
+#define SET(bits, i) ((bits)[(i) >> 6] |= 1ull << ((i) & 63))
+#define CLEAR(bits, i) ((bits)[(i) >> 6] &= ~(1ull << ((i) & 63)))
+#define GOLDEN 11400714819323198485ull  /* 2^64 / phi, for fibonacci hashing */
+
+#define PRIME(p) { p, UINT64_MAX / p + 1 }  /* prime and its fastmod multiplier */
+
+#ifdef MAP_STATS
+#define COUNT(map, counter, n) ((map)->counters->counter += (n))
+#else
+#define COUNT(map, counter, n) ((void)0)
+#endif
+
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void)(p))
+#endif
+
+#define CHUNK_MIN 4096      /* smallest key arena chunk, in bytes */
+#define CHUNK_MAX (1 << 20) /* chunks stop doubling here */
+#define CLASSES 32          /* free lists for records up to 8 * CLASSES bytes */
+
+#define KEYLEN(key) (((size_t*)(key))[-1])  /* length prefix stored before a key */
+#define INLINE 15           /* longest key stored in the entry itself */
+#define LONG_KEY 16         /* last inline byte of a key kept in the arena */
+#define RECORD(len) ((sizeof(size_t) + (len) + 1 + 7) & ~(size_t)7) /* arena bytes of a key */
 
 /*********
  * entry *
  *********/
 
 struct entry {
-    char* key;
+    uint64_t hash;    /* full hash of key, spares rehashing and most compares */
+    union {
+        char in[16];  /* short keys, nul padded, in[15] is INLINE - len */
+        char* out;    /* longer keys, in the key arena, in[15] is LONG_KEY */
+    } key;            /* nul terminated for convenience either way */
     uintptr_t val;    /* can also be a int, long, etc < 8 bytes */
-    int psl;
+};
+
+/*********
+ * chunk *
+ *********/
+
+struct chunk {
+    struct chunk* next;
+    size_t size;
+    size_t used;
+    char data[];      /* length prefixed keys, back to back */
+};
+
+/*********
+ * arena *
+ *********/
+
+struct arena {
+    struct chunk* head;   /* chunk being bumped into, older chunks follow */
+    size_t live;          /* bytes of keys still in the map */
+    size_t dead;          /* bytes of deleted keys, reclaimed by compaction */
+    char* free[CLASSES];  /* released keys by record size / 8, linked through their bytes */
+};
+
+/************
+ * counters *
+ ************/
+
+/* cumulative, kept only when built with MAP_STATS */
+
+struct counters {
+    uint64_t probes;      /* groups of slots probed by lookups */
+    uint64_t compares;    /* keys compared */
+    uint64_t resizes;     /* tables replaced, at once or incrementally */
+    uint64_t backshifts;  /* entries moved back by deletes */
 };
 
 /***********
@@ -21,364 +105,1651 @@ struct entry {
  ***********/
 
 struct hashmap {
-    struct entry** entries;
+    struct entry* entries;      /* flat slot array, cap + PSL_MAX long */
+    uint8_t* psls;              /* psl + 1 of each slot, 0 if the slot is empty */
+    uint8_t* tags;              /* TAG of each slot's hash, 0 if the slot is empty */
+    uint64_t* used;             /* bit i set if slot i has an entry, for scans */
     void (*val_free)(void*);    /* free's value data structure */
+    struct arena keys;          /* owns every key, tables being rehashed share it */
+    uint64_t (*hash)(const void*, size_t);
+    int flags;                  /* MAP_POW2, MAP_INCREMENTAL */
+    int shift;                  /* 64 - log2(cap) when MAP_POW2 is set */
+    uint64_t magic;             /* fastmod multiplier for cap otherwise */
     int cap;
-    int len;
+    int len;                    /* entries in this table, not counting old */
     int cost;                   /* sum of psl of all entries */
     int maxpsl;                 /* max probe sequence length */
     int pos;                    /* is either the index of an entry in the map or -1 */
+    struct hashmap* old;        /* table being rehashed from, or 0 */
+    int moved;                  /* slots of old already migrated */
+    struct counters* counters;  /* own, or those of the map a table is rehashed for */
+    struct counters own;
+};
+
+/**********
+ * primes *
+ **********/
+
+/* roughly doubling primes, each far from a power of two */
+
+static const struct prime {
+    uint32_t prime;
+    uint64_t magic;             /* ceil(2^64 / prime) */
+} primes[] = {
+    PRIME(2), PRIME(3), PRIME(5), PRIME(7), PRIME(11), PRIME(17), PRIME(29),
+    PRIME(53), PRIME(97), PRIME(193), PRIME(389), PRIME(769), PRIME(1543),
+    PRIME(3079), PRIME(6151), PRIME(12289), PRIME(24593), PRIME(49157),
+    PRIME(98317), PRIME(196613), PRIME(393241), PRIME(786433), PRIME(1572869),
+    PRIME(3145739), PRIME(6291469), PRIME(12582917), PRIME(25165843),
+    PRIME(50331653), PRIME(100663319), PRIME(201326611), PRIME(402653189),
+    PRIME(805306457), PRIME(1610612741)
 };
 
+#define NPRIMES (int)(sizeof(primes) / sizeof(primes[0]))
+
+/*********************************************************************
+ *                                                                   *
+ *                             key arena                             *
+ *                                                                   *
+ *********************************************************************/
+
+/**************
+ * arena_copy *
+ **************/
+
+/* copies key, with its length prefix and nul terminator, into a recycled record or the head chunk */
+
+static char*
+arena_copy(struct arena* arena, const void* key, size_t len)
+{
+    struct chunk* chunk;
+    size_t need, size;
+    char* dst;
+
+    need = RECORD(len);
+    chunk = arena->head;
+
+    if (need / 8 < CLASSES && arena->free[need / 8]) {
+
+        /* recycle a released key of the same record size */
+        dst = arena->free[need / 8];
+        memcpy(&arena->free[need / 8], dst, sizeof(char*));
+        arena->dead -= need;
+    } else {
+
+        /* head is full, start a bigger chunk */
+        if (chunk == 0 || chunk->used + need > chunk->size) {
+            size = chunk ? 2 * chunk->size : CHUNK_MIN;
+            if (size > CHUNK_MAX)
+                size = CHUNK_MAX;
+            if (size < need)
+                size = need;
+
+            chunk = malloc(sizeof(struct chunk) + size);
+            chunk->next = arena->head;
+            chunk->size = size;
+            chunk->used = 0;
+            arena->head = chunk;
+        }
+
+        dst = chunk->data + chunk->used + sizeof(size_t);
+        chunk->used += need;
+    }
+
+    arena->live += need;
+    KEYLEN(dst) = len;
+    memcpy(dst, key, len);
+    dst[len] = 0;
+    return dst;
+}
+
+/*****************
+ * arena_release *
+ *****************/
+
+/* gives back the bytes of a key no longer in the map, for the next key of its size */
+
+static void
+arena_release(struct arena* arena, char* key)
+{
+    struct chunk* chunk;
+    size_t size;
+
+    size = RECORD(KEYLEN(key));
+    chunk = arena->head;
+    arena->live -= size;
+
+    /* the last key bumped is simply unbumped */
+    if (key - sizeof(size_t) + size == chunk->data + chunk->used) {
+        chunk->used -= size;
+        return;
+    }
+
+    arena->dead += size;
+
+    /* every record has room for the link after its prefix */
+    if (size / 8 < CLASSES) {
+        memcpy(key, &arena->free[size / 8], sizeof(char*));
+        arena->free[size / 8] = key;
+    }
+}
+
+/**************
+ * arena_free *
+ **************/
+
+static void
+arena_free(struct arena* arena)
+{
+    struct chunk* next;
+
+    for (; arena->head; arena->head = next) {
+        next = arena->head->next;
+        free(arena->head);
+    }
+
+    *arena = (struct arena){ 0 };
+}
+
 /*********************************************************************
  *                                                                   *
  *                      constructor / destructor                     *
  *                                                                   *
  *********************************************************************/
 
-/***************
- * entry_alloc *
- ***************/
+/*************
+ * key_image *
+ *************/
 
-static struct entry* 
-entry_alloc(char* key, uintptr_t val)
+/* 
+ * the 16 bytes a short key takes inside an entry, so that comparing keys is 
+ * comparing two words.  longer keys only get the LONG_KEY marker.
+ */
+
+static void
+key_image(uint64_t image[2], const void* key, size_t len)
 {
-    struct entry* entry;
-    
-    entry = malloc(sizeof(struct entry));
-    entry->key = strdup(key);
+    image[0] = 0;
+    image[1] = 0;
+
+    if (len <= INLINE) {
+        memcpy(image, key, len);
+        ((char*)image)[15] = INLINE - len;
+    } else {
+        ((char*)image)[15] = LONG_KEY;
+    }
+}
+
+/**************
+ * entry_init *
+ **************/
+
+/* short keys are copied into the entry, longer ones into the arena of map */
+
+static void
+entry_init(struct hashmap* map, struct entry* entry, const void* key, size_t len, 
+           uintptr_t val, uint64_t hash)
+{
+    uint64_t image[2];
+
+    key_image(image, key, len);
+    memcpy(entry->key.in, image, 16);
+
+    if (len > INLINE)
+        entry->key.out = arena_copy(&map->keys, key, len);
+
+    entry->hash = hash;
     entry->val = val;
-    entry->psl = 0;
-    return entry;
 }
 
 /**************
  * entry_free *
  **************/
 
+/* releases the key and value of an entry */
+
 static void
-entry_free(struct entry* entry, void (*val_free)(void*)) 
+entry_free(struct hashmap* map, struct entry* entry) 
 {
-    free(entry->key);
-    if (val_free)
-        val_free((void*)entry->val);
-    free(entry);
+    if (entry->key.in[15] == LONG_KEY)
+        arena_release(&map->keys, entry->key.out);
+    if (map->val_free)
+        map->val_free((void*)entry->val);
 }
 
 /*************
- * map_alloc *
+ * entry_key *
+ *************/
+
+static const char*
+entry_key(const struct entry* entry)
+{
+    return entry->key.in[15] == LONG_KEY ? entry->key.out : entry->key.in;
+}
+
+/*************
+ * entry_len *
  *************/
 
+static size_t
+entry_len(const struct entry* entry)
+{
+    return entry->key.in[15] == LONG_KEY ? KEYLEN(entry->key.out) 
+                                           : (size_t)(INLINE - entry->key.in[15]);
+}
+
+/************
+ * entry_eq *
+ ************/
+
+/* 1 if entry holds key, whose image is given, short keys need no pointer chase */
+
+static int
+entry_eq(const struct entry* entry, const void* key, size_t len, const uint64_t image[2])
+{
+    uint64_t words[2];
+
+    if (len <= INLINE) {
+        memcpy(words, entry->key.in, 16);
+        return words[0] == image[0] && words[1] == image[1];
+    }
+
+    return entry->key.in[15] == LONG_KEY && KEYLEN(entry->key.out) == len
+           && memcmp(entry->key.out, key, len) == 0;
+}
+
+/****************
+ * map_alloc_ex *
+ ****************/
+
+static uint64_t prime_magic(int cap);
+
+/* a null hash selects map_hash_wyhash, MAP_POW2 rounds cap up to a power of two */
+
 struct hashmap*
-map_alloc(int cap, void (*val_free)(void*))
+map_alloc_ex(int cap, void (*val_free)(void*), uint64_t (*hash)(const void*, size_t),
+             int flags)
 {
     struct hashmap* map;
-    struct entry** entries;
+    int pow2;
    
     map = malloc(sizeof(struct hashmap));
-    entries = calloc(cap, sizeof(struct entry*));
+    map->flags = flags;
+    map->shift = 64;
+
+    /* round up to a power of two, at least 2 */
+    if (flags & MAP_POW2) {
+        for (pow2 = 2, map->shift = 63; pow2 < cap; pow2 <<= 1)
+            map->shift--;
+        cap = pow2;
+    } else {
+        map->magic = prime_magic(cap);
+    }
+
+    map->entries = calloc(cap + PSL_MAX, sizeof(struct entry));
+    map->psls = calloc(cap + PSL_MAX + GROUP, sizeof(uint8_t));
+    map->used = calloc(WORDS(cap + PSL_MAX), sizeof(uint64_t));
+    map->tags = calloc(cap + PSL_MAX + GROUP, sizeof(uint8_t));
     map->cap = cap;
     map->len = 0;
     map->cost = 0;
     map->maxpsl = 0;
     map->pos = -1;
-    map->entries = entries;
+    map->old = 0;
+    map->moved = 0;
     map->val_free = val_free;
+    map->keys = (struct arena){ 0 };
+    map->own = (struct counters){ 0 };
+    map->counters = &map->own;
+    map->hash = hash ? hash : map_hash_wyhash;
     return map;
 }
 
+/*************
+ * map_alloc *
+ *************/
+
+struct hashmap*
+map_alloc(int cap, void (*val_free)(void*))
+{
+    return map_alloc_ex(cap, val_free, 0, 0);
+}
+
 /************
  * map_free *
  ************/
 
+static int used(const struct hashmap* map, int i);
+
 void
 map_free(struct hashmap* map) 
 {
-    for (int i = 0; i < map->cap; i++) {
-        struct entry* entry;
-	
-	    entry = map->entries[i];
+    if (map->old)
+        map_free(map->old);
 
-        if (entry)
-            entry_free(entry, map->val_free);
-    }
+    /* keys go with the arena, only values need a walk */
+    if (map->val_free)
+        for (int i = used(map, 0); i < map->cap + PSL_MAX; i = used(map, i + 1))
+            map->val_free((void*)map->entries[i].val);
 
+    arena_free(&map->keys);
     free(map->entries);
+    free(map->psls);
+    free(map->used);
+    free(map->tags);
     free(map);
 }
 
 /*********************************************************************
  *                                                                   *
- *                              utility                              *
+ *                              hashing                              *
  *                                                                   *
  *********************************************************************/
 
-/*******
- * max *
- *******/
-
-static int
-min(int a, int b)
-{
-    return a < b ? a : b;
-}
+/*****************
+ * map_hash_djb2 *
+ *****************/
 
-/*******
- * max *
- *******/
+/* djb2 http://www.cse.yorku.ca/~oz/hash.html */
 
-static int
-max(int a, int b)
+uint64_t
+map_hash_djb2(const void* key, size_t len)
 {
-    return a > b ? a : b;
-}
+    const unsigned char* str;
+    uint64_t hash;
 
-/************
- * is_prime *
- ************/
+    str = key;
+    hash = BASE_PRIME;
 
-/* 1 if prime, 0 if not */
+    while (len--)
+        hash = ((hash << 5) + hash) + *str++; /* hash * 33 + c */
 
-static int
-is_prime(int n)
-{
-    if (n <= 1)
-        return 0;
-    
-    if (n == 2 || n == 3)
-        return 1;
-    
-    if (n % 2 == 0 || n % 3 == 0)
-        return 0;
-    
-    for (int i = 5; i * i <= n; i = i + 6)
-        if (n % i == 0 || n % (i + 2) == 0)
-            return 0;
- 
-    return 1;
+    return hash;
 }
 
-/**************
- * next_prime *
- **************/
+/*********
+ * wymum *
+ *********/
 
-/* finds closest prime to n greater than n */
+/* 64 x 64 -> 128 bit multiply, low half in a and high half in b */
 
-static int
-next_prime(int n)
+static void
+wymum(uint64_t* a, uint64_t* b)
 {
-    int i;
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r;
+
+    r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha, hb, la, lb, rh, rm0, rm1, rl, t, c;
+
+    ha = *a >> 32;
+    hb = *b >> 32;
+    la = (uint32_t)*a;
+    lb = (uint32_t)*b;
+
+    rh = ha * hb;
+    rm0 = ha * lb;
+    rm1 = hb * la;
+    rl = la * lb;
+
+    t = rl + (rm0 << 32);
+    c = t < rl;
+    *a = t + (rm1 << 32);
+    c += *a < t;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
 
-    i = 0;
-    while (!is_prime(n)) {
-        n++;
-        i++;
-    }
+/*********
+ * wymix *
+ *********/
 
-    return n;
+static uint64_t
+wymix(uint64_t a, uint64_t b)
+{
+    wymum(&a, &b);
+    return a ^ b;
 }
 
 /********
- * hash *
+ * wyr8 *
  ********/
 
-/* djb2 http://www.cse.yorku.ca/~oz/hash.html */
+/* unaligned little endian reads */
 
 static uint64_t
-hash(char* str)
+wyr8(const uint8_t* p)
 {
-    uint64_t hash;
-    int c;
-
-    hash = BASE_PRIME;
-
-    while (c = *str++)
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    uint64_t v;
 
-    return hash;
+    memcpy(&v, p, 8);
+    return v;
 }
 
 /********
- * find *
+ * wyr4 *
  ********/
 
-/* returns index into map the key value pair lives, or MAP_ENOENTRY if not found */
-
-static int
-find(struct hashmap* map, char* key)
+static uint64_t
+wyr4(const uint8_t* p)
 {
-    struct entry* entry;
-    int idx, mean, up, down;
+    uint32_t v;
 
-    mean = map->cost / map->len;
-    down = mean + 1;
-    up = mean;
+    memcpy(&v, p, 4);
+    return v;
+}
 
-    idx = hash(key) % map->cap;
+/*******************
+ * map_hash_wyhash *
+ *******************/
 
-    while (1) {
-        
-        /* fail if we exceed boundary */
-        if (idx + up < 0 && idx + down >= map->cap)
-            return MAP_ENOENTRY;
-        
-        /* fail if we exceed maxpsl */
-        if (down - up > 2 * map->maxpsl + 1) {
-            return MAP_ENOENTRY;
-        }
+/* 
+ * wyhash final 4 https://github.com/wangyi-fudan/wyhash (unlicense),
+ * reads keys 8 or 16 bytes at a time and mixes with a 128 bit multiply 
+ */
 
-        if (idx + up >= 0) {
-            entry = map->entries[idx + up];
-            if (entry && strcmp(entry->key, key) == 0)
-                return idx + up;
-        }
-        
-        if (idx + down < map->cap) {
-            entry = map->entries[idx + down];
-            if (entry && strcmp(entry->key, key) == 0)
-                return idx + down;
+uint64_t
+map_hash_wyhash(const void* key, size_t len)
+{
+    static const uint64_t secret[4] = {
+        0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+        0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+    };
+    const uint8_t* p;
+    uint64_t seed, a, b;
+    size_t i;
+
+    p = key;
+    seed = wymix(secret[0], secret[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
         }
+    } else {
+        i = len;
 
-        down++;
-        up--;
-    }
-}
+        if (i > 48) {
+            uint64_t see1, see2;
 
-/**********
- * resize *
- **********/
+            see1 = seed;
+            see2 = seed;
 
-/* resizes map up to a prime close to new_cap */
+            do {
+                seed = wymix(wyr8(p) ^ secret[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ secret[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ secret[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
 
-static void
-resize(struct hashmap* map, int new_cap)
-{
-    struct hashmap* new;
-    struct entry** tmp;
+            seed ^= see1 ^ see2;
+        }
 
-    new_cap = next_prime(new_cap);
-    
-    new = map_alloc(new_cap, map->val_free);
-    for (int i = 0; i < min(map->cap, new_cap); i++) {
-        new->entries[i] = map->entries[i];
-        map->entries[i] = 0;
-    }
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ secret[1], wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
 
-    tmp = map->entries;
-    new->cap = map->cap;
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
 
-    map->cap = new_cap;
-    map->entries = new->entries;
+    a ^= secret[1];
+    b ^= seed;
+    wymum(&a, &b);
 
-    new->entries = tmp;
-    map_free(new);
+    return wymix(a ^ secret[0] ^ len, b ^ secret[1]);
 }
 
-/********
- * grow *
- ********/
-
-static void
-grow(struct hashmap* map)
-{
-    if (map->len >= 3 * map->cap / 4) {
-        resize(map, 2 * map->cap);
-    }
-}
+/************
+ * map_hash *
+ ************/
 
-/**********
- * shrink *
- **********/
+/* hash of key under map, for the _h functions */
 
-static void
-shrink(struct hashmap* map)
+uint64_t
+map_hash(struct hashmap* map, const void* key, size_t len)
 {
-    if (map->len <= map->cap / 4) {
-        resize(map, map->cap / 2);
-    }
+    return map->hash(key, len);
 }
 
 /*********************************************************************
  *                                                                   *
- *                             insertion                             *
+ *                              utility                              *
  *                                                                   *
  *********************************************************************/
 
-/***********
- * map_set *
- ***********/
-
-/* sets the value of an entry with specified key, or returns MAP_ENOENTRY */
+/*******
+ * max *
+ *******/
 
-int
-map_set(struct hashmap* map, char* key, uintptr_t val) 
+static int
+max(int a, int b)
 {
-    struct entry *new, *old;
-    int idx;
+    return a > b ? a : b;
+}
 
-    idx = find(map, key);
+/**************
+ * next_prime *
+ **************/
 
-    /* key not in map */
-    if (idx < 0)
-        return MAP_ENOENTRY;
+/* smallest prime from the table that is >= n */
 
-    new = entry_alloc(key, val);
-    old = map->entries[idx];
+static int
+next_prime(int n)
+{
+    int i;
 
-    map->entries[idx] = new;
-    entry_free(old, map->val_free);
+    for (i = 0; i < NPRIMES - 1 && (int)primes[i].prime < n; i++)
+        ;
 
-    return 0;
+    return primes[i].prime;
 }
 
-/***********
+/***************
+ * prime_magic *
+ ***************/
+
+/* fastmod multiplier for cap, precomputed when cap comes from the table */
+
+static uint64_t
+prime_magic(int cap)
+{
+    for (int i = 0; i < NPRIMES; i++)
+        if ((int)primes[i].prime == cap)
+            return primes[i].magic;
+
+    return UINT64_MAX / cap + 1;
+}
+
+/***********
+ * fastmod *
+ ***********/
+
+/* 
+ * a % d for 32 bit a and d, given magic = ceil(2^64 / d), in two multiplies
+ * https://arxiv.org/abs/1902.01961 
+ */
+
+static uint32_t
+fastmod(uint32_t a, uint64_t magic, uint32_t d)
+{
+    uint64_t lo, hi;
+
+    lo = magic * a;
+    hi = d;
+    wymum(&lo, &hi);
+
+    return hi;
+}
+
+/**********
+ * reduce *
+ **********/
+
+/* maps a hash onto its home slot */
+
+static int
+reduce(struct hashmap* map, uint64_t h)
+{
+    /* fibonacci hashing, the top bits of the product depend on every bit of h */
+    if (map->flags & MAP_POW2)
+        return (h * GOLDEN) >> map->shift;
+
+    /* fold the hash to 32 bits for fastmod */
+    return fastmod(h ^ (h >> 32), map->magic, map->cap);
+}
+
+/*******
+ * ctz *
+ *******/
+
+/* index of the lowest set bit, mask must be nonzero */
+
+static int
+ctz(uint32_t mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int i;
+
+    for (i = 0; !(mask & 1); i++)
+        mask >>= 1;
+
+    return i;
+#endif
+}
+
+/*********
+ * ctz64 *
+ *********/
+
+static int
+ctz64(uint64_t mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask);
+#else
+    int i;
+
+    for (i = 0; !(mask & 1); i++)
+        mask >>= 1;
+
+    return i;
+#endif
+}
+
+/********
+ * used *
+ ********/
+
+/* first slot from i on with an entry, or cap + PSL_MAX, skipping 64 empty slots a word */
+
+static int
+used(const struct hashmap* map, int i)
+{
+    uint64_t word;
+    int n;
+
+    n = map->cap + PSL_MAX;
+    if (i >= n)
+        return n;
+
+    word = map->used[i >> 6] & (~0ull << (i & 63));
+
+    while (word == 0) {
+        i = (i | 63) + 1;
+        if (i >= n)
+            return n;
+        word = map->used[i >> 6];
+    }
+
+    return (i & ~63) + ctz64(word);
+}
+
+/***************
+ * group_probe *
+ ***************/
+
+/* 
+ * compares the GROUP slots starting at idx against a probe that reaches
+ * idx with the given psl + 1.  returns a mask of slots whose entry shares
+ * our home and fingerprint, and sets stop to a mask of slots that are
+ * empty or closer to home than the probe, where robin hood gives up.
+ */
+
+static uint32_t
+group_probe(struct hashmap* map, int idx, int psl, uint8_t tag, uint32_t* stop)
+{
+#if defined(__AVX2__)
+    __m256i dist, psls, tags, home;
+
+    dist = _mm256_add_epi8(_mm256_set1_epi8(psl), _mm256_setr_epi8(
+                0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31));
+    psls = _mm256_loadu_si256((const __m256i*)(map->psls + idx));
+    tags = _mm256_loadu_si256((const __m256i*)(map->tags + idx));
+
+    home = _mm256_cmpeq_epi8(psls, dist);
+    *stop = ~(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_max_epu8(psls, dist), psls));
+
+    return (uint32_t)_mm256_movemask_epi8(
+            _mm256_and_si256(home, _mm256_cmpeq_epi8(tags, _mm256_set1_epi8(tag))));
+#elif defined(__SSE2__)
+    __m128i dist, psls, tags, home;
+
+    dist = _mm_add_epi8(_mm_set1_epi8(psl), _mm_setr_epi8(
+                0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    psls = _mm_loadu_si128((const __m128i*)(map->psls + idx));
+    tags = _mm_loadu_si128((const __m128i*)(map->tags + idx));
+
+    home = _mm_cmpeq_epi8(psls, dist);
+    *stop = ~_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_max_epu8(psls, dist), psls)) & 0xffff;
+
+    return _mm_movemask_epi8(
+            _mm_and_si128(home, _mm_cmpeq_epi8(tags, _mm_set1_epi8(tag))));
+#else
+    uint32_t match;
+
+    match = 0;
+    *stop = 0;
+
+    for (int i = 0; i < GROUP; i++) {
+        if (map->psls[idx + i] < psl + i)
+            *stop |= 1u << i;
+        if (map->psls[idx + i] == psl + i && map->tags[idx + i] == tag)
+            match |= 1u << i;
+    }
+
+    return match;
+#endif
+}
+
+/***********
+ * find_at *
+ ***********/
+
+/* 
+ * returns index into map the key value pair lives, or MAP_ENOENTRY if not 
+ * found.  on a miss, sets *at and *at_psl, if given, to the first slot an 
+ * insert of key would take or swap, and its psl there.
+ */
+
+static int
+find_at(struct hashmap* map, const void* key, size_t len, uint64_t h, int* at, int* at_psl)
+{
+    uint64_t image[2];
+    uint32_t match, stop;
+    int idx, psl, i;
+
+    key_image(image, key, len);
+    idx = reduce(map, h);
+
+    /* probe a group of slots at a time */
+    for (psl = 1; ; psl += GROUP, idx += GROUP) {
+        match = group_probe(map, idx, psl, TAG(h), &stop);
+        COUNT(map, probes, 1);
+
+        /* robin hood early exit, ignore slots past the first stop */
+        match &= (stop & -stop) - 1;
+
+        while (match) {
+            struct entry* entry;
+
+            i = idx + ctz(match);
+            entry = &map->entries[i];
+            if (entry->hash == h) {
+                COUNT(map, compares, 1);
+                if (entry_eq(entry, key, len, image))
+                    return i;
+            }
+            match &= match - 1;
+        }
+
+        if (stop) {
+            if (at) {
+                *at = idx + ctz(stop);
+                *at_psl = psl + ctz(stop);
+            }
+            return MAP_ENOENTRY;
+        }
+    }
+}
+
+/********
+ * find *
+ ********/
+
+static int
+find(struct hashmap* map, const void* key, size_t len, uint64_t h)
+{
+    return find_at(map, key, len, h, 0, 0);
+}
+
+/**********
+ * lookup *
+ **********/
+
+/* entry with key in either table, or 0 if not found */
+
+static struct entry*
+lookup(struct hashmap* map, const void* key, size_t len, uint64_t h)
+{
+    int idx;
+
+    idx = find(map, key, len, h);
+    if (idx >= 0)
+        return &map->entries[idx];
+
+    if (map->old) {
+        idx = find(map->old, key, len, h);
+        if (idx >= 0)
+            return &map->old->entries[idx];
+    }
+
+    return 0;
+}
+
+/*********
+ * count *
+ *********/
+
+/* entries in the map, across both tables while rehashing */
+
+static int
+count(struct hashmap* map)
+{
+    return map->len + (map->old ? map->old->len : 0);
+}
+
+/*************
+ * insert_at *
+ *************/
+
+static void resize(struct hashmap* map, int new_cap);
+
+/* 
+ * robin hood insertion of an entry whose key is not in the map, picking up
+ * the probe at slot idx with psl, as left by find_at.  returns the slot the 
+ * entry landed in, meaningless if the table was resized
+ */
+
+static int
+insert_at(struct hashmap* map, struct entry new, int idx, int psl)
+{
+    struct entry tmp;
+    int old, slot;
+
+    slot = -1;
+    map->cost += psl - 1;
+
+    /* probe routine */
+    while (1) {
+
+        /* probe sequence too long, grow and start over from new home */
+        if (psl > PSL_MAX) {
+            map->cost -= psl - 1;
+            resize(map, 2 * map->cap);
+            idx = reduce(map, new.hash);
+            psl = 1;
+        }
+        
+        /* empty slot */
+        if (map->psls[idx] == 0) {
+            break;        
+        }
+
+        /* swap */
+        if (map->psls[idx] < psl) {
+            if (slot < 0)
+                slot = idx;
+            tmp = map->entries[idx];
+            map->entries[idx] = new;
+            map->tags[idx] = TAG(new.hash);
+            map->maxpsl = max(map->maxpsl, psl - 1);
+            new = tmp;
+            old = map->psls[idx];
+            map->psls[idx] = psl;
+            psl = old;
+        }
+
+        idx++;
+        psl++;
+        map->cost++;
+    }
+
+    map->maxpsl = max(map->maxpsl, psl - 1);
+    map->entries[idx] = new;
+    map->psls[idx] = psl;
+    map->tags[idx] = TAG(new.hash);
+    SET(map->used, idx);
+    map->len++;
+
+    return slot < 0 ? idx : slot;
+}
+
+/**********
+ * insert *
+ **********/
+
+/* robin hood insertion from the entry's home slot */
+
+static int
+insert(struct hashmap* map, struct entry new)
+{
+    return insert_at(map, new, reduce(map, new.hash), 1);
+}
+
+/*************
+ * overflows *
+ *************/
+
+/* whether inserting at home idx would carry some entry past PSL_MAX, reads only psls */
+
+static int
+overflows(struct hashmap* map, int idx)
+{
+    for (int psl = 1; ; idx++, psl++) {
+        if (psl > PSL_MAX)
+            return 1;
+        if (map->psls[idx] == 0)
+            return 0;
+        if (map->psls[idx] < psl)
+            psl = map->psls[idx];
+    }
+}
+
+/********
+ * room *
+ ********/
+
+/* 
+ * makes sure a new entry with hash h can be inserted, growing the map if 
+ * that spreads its probe out.  keys sharing a hash share a home at every 
+ * capacity, so a map this empty is not grown for them, returns 0 instead.
+ * an insert moves each psl up by at most one, so below PSL_MAX - 1 there
+ * is nothing to check.
+ */
+
+static int
+room(struct hashmap* map, uint64_t h)
+{
+    /* 
+     * while rehashing, keys sharing a hash can sit in both tables and meet
+     * again as old is moved.  under half of PSL_MAX in each they still fit
+     * together, past that finish the move so one table holds them all
+     */
+    if (map->old && max(map->maxpsl, map->old->maxpsl) >= PSL_MAX / 2)
+        resize(map, map->cap);
+
+    while (map->maxpsl >= PSL_MAX - 1 && overflows(map, reduce(map, h))) {
+        if (count(map) < map->cap / 8)
+            return 0;
+        resize(map, 2 * map->cap);
+    }
+
+    return 1;
+}
+
+/*********
+ * erase *
+ *********/
+
+/* takes the entry at idx out of the table, without freeing it */
+
+static void
+erase(struct hashmap* map, int idx)
+{
+    map->cost -= map->psls[idx] - 1;
+    map->psls[idx] = 0;
+    map->tags[idx] = 0;
+
+    map->len--;
+    idx++;   
+
+    /* back-shift routine, leave my brother once he is home */
+
+    while (idx < map->cap + PSL_MAX && map->psls[idx] > 1) {
+        map->entries[idx - 1] = map->entries[idx];
+        map->psls[idx - 1] = map->psls[idx] - 1;
+        map->tags[idx - 1] = map->tags[idx];
+        map->psls[idx] = 0;
+        map->tags[idx] = 0;
+        map->cost--;
+        COUNT(map, backshifts, 1);
+        idx++;
+    }
+
+    /* occupancy only changes where the shift stopped */
+    CLEAR(map->used, idx - 1);
+}
+
+/***************
+ * swap_tables *
+ ***************/
+
+/* exchanges the slot arrays, and everything describing them, of two maps */
+
+static void
+swap_tables(struct hashmap* a, struct hashmap* b)
+{
+    struct hashmap tmp;
+
+    tmp = *a;
+
+    a->entries = b->entries;
+    a->psls = b->psls;
+    a->used = b->used;
+    a->tags = b->tags;
+    a->cap = b->cap;
+    a->shift = b->shift;
+    a->magic = b->magic;
+    a->len = b->len;
+    a->cost = b->cost;
+    a->maxpsl = b->maxpsl;
+
+    b->entries = tmp.entries;
+    b->psls = tmp.psls;
+    b->used = tmp.used;
+    b->tags = tmp.tags;
+    b->cap = tmp.cap;
+    b->shift = tmp.shift;
+    b->magic = tmp.magic;
+    b->len = tmp.len;
+    b->cost = tmp.cost;
+    b->maxpsl = tmp.maxpsl;
+}
+
+/**************
+ * drop_table *
+ **************/
+
+/* frees a table whose entries have all been moved elsewhere */
+
+static void
+drop_table(struct hashmap* map)
+{
+    free(map->entries);
+    free(map->psls);
+    free(map->used);
+    free(map->tags);
+    free(map);
+}
+
+/**************
+ * table_with *
+ **************/
+
+/* an empty table for the map with a prime, or power of two, capacity close to cap */
+
+static struct hashmap*
+table_with(struct hashmap* map, int cap)
+{
+    struct hashmap* new;
+    int prime;
+
+    if (!(map->flags & MAP_POW2)) {
+        prime = next_prime(cap);
+
+        /* a shrink must not round back up to the current size */
+        for (int i = NPRIMES - 1; i >= 0 && cap < map->cap && prime >= map->cap; i--)
+            prime = primes[i].prime;
+
+        cap = prime;
+    }
+
+    new = map_alloc_ex(cap, map->val_free, map->hash, map->flags);
+    new->counters = map->counters;
+    COUNT(map, resizes, 1);
+    return new;
+}
+
+/***********
+ * compact *
+ ***********/
+
+/* 
+ * once deleted keys outweigh live ones, copies the live keys of both tables
+ * into one fresh chunk and frees the rest of the arena 
+ */
+
+static void
+compact(struct hashmap* map)
+{
+    struct hashmap* tables[2] = { map, map->old };
+    struct arena fresh;
+    struct entry* entry;
+    size_t size;
+
+    if (map->keys.dead <= map->keys.live || map->keys.dead < CHUNK_MIN)
+        return;
+
+    size = map->keys.live > CHUNK_MIN ? map->keys.live : CHUNK_MIN;
+    fresh = (struct arena){ 0 };
+    fresh.head = malloc(sizeof(struct chunk) + size);
+    fresh.head->next = 0;
+    fresh.head->size = size;
+    fresh.head->used = 0;
+
+    for (int t = 0; t < 2 && tables[t]; t++) {
+        for (int i = used(tables[t], 0); i < tables[t]->cap + PSL_MAX; i = used(tables[t], i + 1)) {
+            entry = &tables[t]->entries[i];
+            if (entry->key.in[15] == LONG_KEY)
+                entry->key.out = arena_copy(&fresh, entry->key.out, KEYLEN(entry->key.out));
+        }
+    }
+
+    arena_free(&map->keys);
+    map->keys = fresh;
+}
+
+/**********
+ * resize *
+ **********/
+
+/* moves every entry, from both tables if rehashing, into a table close to new_cap */
+
+static void
+resize(struct hashmap* map, int new_cap)
+{
+    struct hashmap* new;
+
+    new = table_with(map, new_cap);
+
+    /* entries carry their hash, so no key is read */
+    for (int i = used(map, 0); i < map->cap + PSL_MAX; i = used(map, i + 1))
+        insert(new, map->entries[i]);
+
+    if (map->old) {
+        for (int i = used(map->old, map->moved); i < map->old->cap + PSL_MAX; 
+                i = used(map->old, i + 1))
+            insert(new, map->old->entries[i]);
+
+        drop_table(map->old);
+        map->old = 0;
+    }
+
+    swap_tables(map, new);
+    drop_table(new);
+
+    /* every entry was just touched, a good time to tidy the keys */
+    compact(map);
+}
+
+/***********
+ * migrate *
+ ***********/
+
+/* 
+ * moves up to n slots worth of entries from the old table into the map.
+ * old slots are emptied in order, taking each entry out with a back-shift,
+ * so whatever is left of old stays a valid robin hood table to search.
+ */
+
+static void
+migrate(struct hashmap* map, int n)
+{
+    struct hashmap* old;
+    struct entry entry;
+
+    while (map->old && n-- > 0) {
+        old = map->old;
+
+        /* successors shift back into this slot, so stay until it is empty */
+        if (old->psls[map->moved]) {
+            entry = old->entries[map->moved];
+            erase(old, map->moved);
+            insert(map, entry);
+        } else if (++map->moved == old->cap + PSL_MAX) {
+            drop_table(old);
+            map->old = 0;
+        }
+    }
+}
+
+/**********
+ * rehash *
+ **********/
+
+/* resize, spread over the following operations with MAP_INCREMENTAL */
+
+static void
+rehash(struct hashmap* map, int new_cap)
+{
+    if (!(map->flags & MAP_INCREMENTAL)) {
+        resize(map, new_cap);
+        return;
+    }
+
+    /* a rehash still running is finished in one go */
+    if (map->old) {
+        resize(map, new_cap);
+        return;
+    }
+
+    /* the current table becomes the old one */
+    map->old = table_with(map, new_cap);
+    map->moved = 0;
+    swap_tables(map, map->old);
+}
+
+/***********
+ * cap_for *
+ ***********/
+
+/* capacity that holds n entries without growing, grow fires once 3/4 full */
+
+static int
+cap_for(int n)
+{
+    return (int)(4 * (int64_t)n / 3) + 2;
+}
+
+/********
+ * grow *
+ ********/
+
+static void
+grow(struct hashmap* map)
+{
+    if (count(map) >= 3 * map->cap / 4) {
+        rehash(map, 2 * map->cap);
+    }
+}
+
+/**********
+ * shrink *
+ **********/
+
+static void
+shrink(struct hashmap* map)
+{
+    if (count(map) <= map->cap / 4) {
+        rehash(map, map->cap / 2);
+    }
+}
+
+/*********************************************************************
+ *                                                                   *
+ *                             insertion                             *
+ *                                                                   *
+ *********************************************************************/
+
+/*************
+ * map_set_h *
+ *************/
+
+/* sets the value of an entry with specified key and hash, or returns MAP_ENOENTRY */
+
+int
+map_set_h(struct hashmap* map, const void* key, size_t len, uint64_t h, uintptr_t val) 
+{
+    struct entry *entry;
+
+    entry = lookup(map, key, len, h);
+
+    /* key not in map */
+    if (entry == 0)
+        return MAP_ENOENTRY;
+
+    /* the key stays, only the value changes */
+    if (map->val_free)
+        map->val_free((void*)entry->val);
+    entry->val = val;
+
+    return 0;
+}
+
+/*************
+ * map_set_n *
+ *************/
+
+int
+map_set_n(struct hashmap* map, const void* key, size_t len, uintptr_t val) 
+{
+    return map_set_h(map, key, len, map->hash(key, len), val);
+}
+
+/***********
+ * map_set *
+ ***********/
+
+int
+map_set(struct hashmap* map, char* key, uintptr_t val) 
+{
+    return map_set_n(map, key, strlen(key), val);
+}
+
+/*************
+ * map_put_h *
+ *************/
+
+/* 
+ * table insertion with robin hood probing, h is the key's hash under map.
+ * returns MAP_ECOLLIDE, leaving the map as it was, if too many keys share 
+ * the hash of key to place it.
+ */
+
+int
+map_put_h(struct hashmap* map, const void* key, size_t len, uint64_t h, uintptr_t val) 
+{
+    struct entry new, *entry;
+
+    migrate(map, MIGRATE_STEP);
+
+    entry = lookup(map, key, len, h);
+
+    /* update existing entry in place */
+    if (entry) {
+        if (map->val_free)
+            map->val_free((void*)entry->val);
+        entry->val = val;
+        return 0;
+    }
+
+    if (!room(map, h))
+        return MAP_ECOLLIDE;
+
+    entry_init(map, &new, key, len, val, h);
+    insert(map, new);
+
+    grow(map);
+
+    return 0;
+}
+
+/*************
+ * map_put_n *
+ *************/
+
+int
+map_put_n(struct hashmap* map, const void* key, size_t len, uintptr_t val) 
+{
+    return map_put_h(map, key, len, map->hash(key, len), val);
+}
+
+/***********
  * map_put *
  ***********/
 
-/* table insertion with robin hood probing */
+int
+map_put(struct hashmap* map, char* key, uintptr_t val) 
+{
+    return map_put_n(map, key, strlen(key), val);
+}
+
+/****************
+ * map_upsert_n *
+ ****************/
+
+/* 
+ * pointer to the value of key, inserting it with value 0 if missing.  sets
+ * *inserted, if given, to whether it was missing.  the pointer is good until
+ * the map is next modified.  returns 0 if key is missing and cannot be 
+ * placed, as map_put_h's MAP_ECOLLIDE.
+ */
+
+uintptr_t*
+map_upsert_n(struct hashmap* map, const void* key, size_t len, int* inserted)
+{
+    struct entry new, *entry, *entries;
+    uint64_t image[2];
+    uint64_t h;
+    int idx, at, at_psl;
+
+    migrate(map, MIGRATE_STEP);
+
+    h = map->hash(key, len);
+
+    /* a miss in the current table leaves the spot the insert continues from */
+    entry = 0;
+    idx = find_at(map, key, len, h, &at, &at_psl);
+    if (idx >= 0)
+        entry = &map->entries[idx];
+    else if (map->old && (idx = find(map->old, key, len, h)) >= 0)
+        entry = &map->old->entries[idx];
+
+    if (inserted)
+        *inserted = entry == 0;
+
+    if (entry)
+        return &entry->val;
+
+    entries = map->entries;
+    if (!room(map, h))
+        return 0;
+
+    entry_init(map, &new, key, len, 0, h);
+
+    /* room may have resized, then the probe starts over from home */
+    if (map->entries == entries)
+        idx = insert_at(map, new, at, at_psl);
+    else
+        idx = insert(map, new);
+
+    grow(map);
+
+    /* still where it landed unless a resize or rehash moved it */
+    key_image(image, key, len);
+    if (idx < map->cap + PSL_MAX && map->psls[idx]) {
+        entry = &map->entries[idx];
+        if (entry->hash == h && entry_eq(entry, key, len, image))
+            return &entry->val;
+    }
+
+    return &lookup(map, key, len, h)->val;
+}
+
+/**************
+ * map_upsert *
+ **************/
+
+uintptr_t*
+map_upsert(struct hashmap* map, char* key, int* inserted)
+{
+    return map_upsert_n(map, key, strlen(key), inserted);
+}
+
+/***********
+ * missing *
+ ***********/
+
+/* how many of n keys are not in the map, a repeated new key counts each time */
+
+static int
+missing(struct hashmap* map, char** keys, int n)
+{
+    uint64_t hashes[BATCH];
+    size_t lens[BATCH];
+    int home, m, misses;
+
+    misses = 0;
+
+    for (int b = 0; b < n; b += BATCH) {
+        m = n - b < BATCH ? n - b : BATCH;
+
+        for (int i = 0; i < m; i++) {
+            lens[i] = strlen(keys[b + i]);
+            hashes[i] = map->hash(keys[b + i], lens[i]);
+            home = reduce(map, hashes[i]);
+            PREFETCH(&map->tags[home]);
+            PREFETCH(&map->psls[home]);
+            PREFETCH(&map->entries[home]);
+        }
+
+        for (int i = 0; i < m; i++)
+            if (lookup(map, keys[b + i], lens[i], hashes[i]) == 0)
+                misses++;
+    }
+
+    return misses;
+}
+
+/*****************
+ * map_put_batch *
+ *****************/
+
+/* 
+ * map_put of n pairs.  room for the new keys among them is made once up 
+ * front, then each batch of keys is hashed and prefetched before any is 
+ * placed.  returns MAP_ECOLLIDE if any key had to be left out, as with 
+ * map_put.
+ */
+
+int
+map_put_batch(struct hashmap* map, char** keys, uintptr_t* vals, int n)
+{
+    struct entry new, *entry;
+    uint64_t hashes[BATCH];
+    size_t lens[BATCH];
+    int home, m, status, fresh;
+
+    status = 0;
+
+    /* 
+     * keys already in the map need no room, and growing for them would 
+     * leave the table for the next delete to shrink, so count the new ones 
+     * whenever the batch might not fit
+     */
+    fresh = n;
+    if (cap_for(count(map) + n) > map->cap)
+        fresh = missing(map, keys, n);
+
+    /* an incremental map moves its entries over the puts, not all at once */
+    if (!(map->flags & MAP_INCREMENTAL))
+        map_reserve(map, count(map) + fresh);
+    else if (!map->old && cap_for(count(map) + fresh) > map->cap)
+        rehash(map, cap_for(count(map) + fresh));
+
+    for (int b = 0; b < n; b += BATCH) {
+        m = n - b < BATCH ? n - b : BATCH;
+
+        migrate(map, m * MIGRATE_STEP);
+
+        for (int i = 0; i < m; i++) {
+            lens[i] = strlen(keys[b + i]);
+            hashes[i] = map->hash(keys[b + i], lens[i]);
+            home = reduce(map, hashes[i]);
+            PREFETCH(&map->tags[home]);
+            PREFETCH(&map->psls[home]);
+            PREFETCH(&map->entries[home]);
+        }
+
+        for (int i = 0; i < m; i++) {
+            entry = lookup(map, keys[b + i], lens[i], hashes[i]);
+
+            /* update existing entry in place */
+            if (entry) {
+                if (map->val_free)
+                    map->val_free((void*)entry->val);
+                entry->val = vals[b + i];
+                continue;
+            }
+
+            if (!room(map, hashes[i])) {
+                status = MAP_ECOLLIDE;
+                continue;
+            }
+
+            entry_init(map, &new, keys[b + i], lens[i], vals[b + i], hashes[i]);
+            insert(map, new);
+
+            /* only fires if a rehash was still running up front */
+            grow(map);
+        }
+    }
+
+    return status;
+}
+
+/***************
+ * map_reserve *
+ ***************/
+
+/* sizes the table once so n entries fit without growing */
 
 void
-map_put(struct hashmap* map, char* key, uintptr_t val) 
+map_reserve(struct hashmap* map, int n)
+{
+    if (cap_for(n) > map->cap)
+        resize(map, cap_for(n));
+}
+
+/*************
+ * map_build *
+ *************/
+
+/* 
+ * bulk loads n pairs into an empty map.  the table is sized once, then 
+ * entries, sorted by home slot, are laid down in robin hood order with no 
+ * swapping.  as with map_put, a repeated key keeps the last value, and
+ * MAP_ECOLLIDE is returned if any key had to be left out.
+ */
+
+int
+map_build(struct hashmap* map, char** keys, uintptr_t* vals, int n)
 {
-    struct entry *new, *old;
-    int idx;
+    struct entry* entry;
+    uint64_t* hashes;
+    uint64_t image[2];
+    int *homes, *order, *start;
+    int next, first, idx, i, k, status;
+    size_t len;
+
+    map_reserve(map, n);
+    status = 0;
+
+    /* nothing to gain over puts on a map with entries */
+    if (count(map)) {
+        for (i = 0; i < n; i++)
+            if (map_put(map, keys[i], vals[i]))
+                status = MAP_ECOLLIDE;
+        return status;
+    }
 
-    new = entry_alloc(key, val);
-    idx = hash(key) % map->cap;
-    
-    /* probe routine */
-    while (1) {
-        
-        old = map->entries[idx];
+    hashes = malloc(n * sizeof(uint64_t));
+    homes = malloc(n * sizeof(int));
+    order = malloc(n * sizeof(int));
+    start = calloc(map->cap + 1, sizeof(int));
 
-        /* empty slot */
-        if (old == 0) {
-            break;        
-        }
+    for (i = 0; i < n; i++) {
+        hashes[i] = map->hash(keys[i], strlen(keys[i]));
+        homes[i] = reduce(map, hashes[i]);
+        start[homes[i] + 1]++;
+    }
 
-        /* update existing entry */
-        if (strcmp(new->key, old->key) == 0) {
-            map->entries[idx] = new;
-            entry_free(old, map->val_free);
-            break;
+    /* counting sort by home, stable so a repeated key stays in input order */
+    for (i = 0; i < map->cap; i++)
+        start[i + 1] += start[i];
+
+    for (i = 0; i < n; i++)
+        order[start[homes[i]]++] = i;
+
+    next = 0;
+    first = 0;
+
+    for (k = 0; k < n; k++) {
+        i = order[k];
+        len = strlen(keys[i]);
+        idx = max(homes[i], next);
+
+        /* entries sharing a home sit together from first on */
+        if (k == 0 || homes[i] != homes[order[k - 1]])
+            first = idx;
+
+        /* repeated key, replace the value */
+        key_image(image, keys[i], len);
+        for (entry = &map->entries[first]; entry < &map->entries[next]; entry++) {
+            if (entry->hash == hashes[i] && entry_eq(entry, keys[i], len, image)) {
+                if (map->val_free)
+                    map->val_free((void*)entry->val);
+                entry->val = vals[i];
+                break;
+            }
         }
 
-        /* swap */
-        if (old->psl < new->psl) {
-            map->entries[idx] = new;
-            new = old;
-        }
+        if (entry < &map->entries[next])
+            continue;
 
-        idx++;
-        new->psl++;
-        map->cost++;
+        /* probe sequence too long, the rest go through puts */
+        if (idx - homes[i] >= PSL_MAX)
+            break;
+
+        entry_init(map, &map->entries[idx], keys[i], len, vals[i], hashes[i]);
+        map->psls[idx] = idx - homes[i] + 1;
+        SET(map->used, idx);
+        map->tags[idx] = TAG(hashes[i]);
+        map->cost += idx - homes[i];
+        map->maxpsl = max(map->maxpsl, idx - homes[i]);
+        map->len++;
+        next = idx + 1;
     }
 
-    map->maxpsl = max(map->maxpsl, new->psl);
-    map->entries[idx] = new;
-    map->len++;
+    for (; k < n; k++)
+        if (map_put(map, keys[order[k]], vals[order[k]]))
+            status = MAP_ECOLLIDE;
 
-    grow(map);
+    free(hashes);
+    free(homes);
+    free(order);
+    free(start);
+
+    return status;
 }
 
 /*********************************************************************
@@ -387,19 +1758,27 @@ map_put(struct hashmap* map, char* key, uintptr_t val)
  *                                                                   *
  *********************************************************************/
 
-/***********
- * map_del *
- ***********/
+/*************
+ * map_del_h *
+ *************/
 
-/* deletes entry with key or MAP_ENOENTRY if no entry with that key exists */
+/* deletes entry with key and hash h or MAP_ENOENTRY if no entry with that key exists */
 
 int
-map_del(struct hashmap* map, char* key)
+map_del_h(struct hashmap* map, const void* key, size_t len, uint64_t h)
 {
-    struct entry* entry;
+    struct hashmap* table;
     int idx;
 
-    idx = find(map, key);
+    migrate(map, MIGRATE_STEP);
+
+    table = map;
+    idx = find(map, key, len, h);
+
+    if (idx < 0 && map->old) {
+        table = map->old;
+        idx = find(table, key, len, h);
+    }
 
     /* key not in map */
     if (idx < 0)
@@ -407,38 +1786,89 @@ map_del(struct hashmap* map, char* key)
 
     /* remove key from map */
 
-    entry = map->entries[idx];
-    map->entries[idx] = 0;
-    map->cost -= entry->psl;
+    entry_free(map, &table->entries[idx]);
+    erase(table, idx);
 
-    entry_free(entry, map->val_free);
+    shrink(map);
+    
+    return 0;    
+}
 
-    map->len--;
-    idx++;   
+/*************
+ * map_del_n *
+ *************/
 
-    /* back-shift routine */
+int
+map_del_n(struct hashmap* map, const void* key, size_t len)
+{
+    return map_del_h(map, key, len, map->hash(key, len));
+}
 
-    while (1) {
-        entry = map->entries[idx];
-        
-        /* not sure what to do here*/
-        if (idx >= map->cap)
-            break;
-        
-        /* leave my brother */
-        if (entry->psl <= 0)
-            break;
+/***********
+ * map_del *
+ ***********/
 
-        entry->psl--;
-        map->cost--;
-        map->entries[idx - 1] = entry;
-        map->entries[idx] = 0;
-        idx++;
+int
+map_del(struct hashmap* map, char* key)
+{
+    return map_del_n(map, key, strlen(key));
+}
+
+/*****************
+ * map_del_batch *
+ *****************/
+
+/* 
+ * map_del of n keys, returns the number deleted.  the table is shrunk, 
+ * straight to its new size, once at the end.
+ */
+
+int
+map_del_batch(struct hashmap* map, char** keys, int n)
+{
+    struct hashmap* table;
+    uint64_t hashes[BATCH];
+    size_t lens[BATCH];
+    int deleted, home, idx, m;
+
+    deleted = 0;
+
+    for (int b = 0; b < n; b += BATCH) {
+        m = n - b < BATCH ? n - b : BATCH;
+
+        migrate(map, m * MIGRATE_STEP);
+
+        for (int i = 0; i < m; i++) {
+            lens[i] = strlen(keys[b + i]);
+            hashes[i] = map->hash(keys[b + i], lens[i]);
+            home = reduce(map, hashes[i]);
+            PREFETCH(&map->tags[home]);
+            PREFETCH(&map->psls[home]);
+            PREFETCH(&map->entries[home]);
+        }
+
+        for (int i = 0; i < m; i++) {
+            table = map;
+            idx = find(map, keys[b + i], lens[i], hashes[i]);
+
+            if (idx < 0 && map->old) {
+                table = map->old;
+                idx = find(table, keys[b + i], lens[i], hashes[i]);
+            }
+
+            if (idx < 0)
+                continue;
+
+            entry_free(map, &table->entries[idx]);
+            erase(table, idx);
+            deleted++;
+        }
     }
 
-    shrink(map);
-    
-    return 0;    
+    if (count(map) <= map->cap / 4)
+        rehash(map, 2 * count(map));
+
+    return deleted;
 }
 
 /*********************************************************************
@@ -447,67 +1877,209 @@ map_del(struct hashmap* map, char* key)
  *                                                                   *
  *********************************************************************/
 
-/***********
- * map_get *
- ***********/
+/*************
+ * map_get_h *
+ *************/
 
-/* smart-search heuristic table lookup */
+/* group probed table lookup of a key whose hash h is already known */
 
 int
-map_get(struct hashmap* map, char* key, uintptr_t* res)
+map_get_h(struct hashmap* map, const void* key, size_t len, uint64_t h, uintptr_t* res)
 {
     struct entry* entry;
-    int idx;
 
-    idx = find(map, key);
+    entry = lookup(map, key, len, h);
 
-    if (idx < 0)
+    if (entry == 0)
         return MAP_ENOENTRY;
 
-    entry = map->entries[idx];
     *res = entry->val;
 
     return 0; 
 }
 
+/*************
+ * map_get_n *
+ *************/
+
+int
+map_get_n(struct hashmap* map, const void* key, size_t len, uintptr_t* res)
+{
+    return map_get_h(map, key, len, map->hash(key, len), res);
+}
+
+/***********
+ * map_get *
+ ***********/
+
+int
+map_get(struct hashmap* map, char* key, uintptr_t* res)
+{
+    return map_get_n(map, key, strlen(key), res);
+}
+
+/*****************
+ * map_get_batch *
+ *****************/
+
+/* 
+ * map_get on n keys, found[i] is 1 if keys[i] is in the map and 0 if not.
+ * every key of a batch is hashed and its home slot prefetched before any
+ * is probed, so the cache misses overlap.  returns the number found.
+ */
+
+int
+map_get_batch(struct hashmap* map, char** keys, int n, uintptr_t* results, int* found)
+{
+    struct entry* entry;
+    uint64_t hashes[BATCH];
+    size_t lens[BATCH];
+    int hits, home, m;
+
+    hits = 0;
+
+    for (int b = 0; b < n; b += BATCH) {
+        m = n - b < BATCH ? n - b : BATCH;
+
+        for (int i = 0; i < m; i++) {
+            lens[i] = strlen(keys[b + i]);
+            hashes[i] = map->hash(keys[b + i], lens[i]);
+            home = reduce(map, hashes[i]);
+            PREFETCH(&map->tags[home]);
+            PREFETCH(&map->psls[home]);
+            PREFETCH(&map->entries[home]);
+        }
+
+        for (int i = 0; i < m; i++) {
+            entry = lookup(map, keys[b + i], lens[i], hashes[i]);
+            found[b + i] = entry != 0;
+
+            if (entry) {
+                results[b + i] = entry->val;
+                hits++;
+            }
+        }
+    }
+
+    return hits;
+}
+
 /*********************************************************************
  *                                                                   *
- *                             iteration                             *
+ *                            statistics                             *
  *                                                                   *
  *********************************************************************/
 
-/************
- * map_next *
- ************/
+/*************
+ * map_stats *
+ *************/
 
-/* sets map->pos equal to the next index with an entry */
+/* fills stats, walks every slot for the histogram so not for hot paths */
 
 void
-map_next(struct hashmap* map)
+map_stats(struct hashmap* map, struct map_stats* stats)
 {
-    struct entry* cur;
-    int i;
+    struct hashmap* tables[2] = { map, map->old };
+    struct chunk* chunk;
+    int psl, bucket, cost;
+
+    *stats = (struct map_stats){ 0 };
+    stats->len = count(map);
+    stats->cap = map->cap;
+    stats->load = (double)stats->len / map->cap;
+    cost = 0;
+
+    for (int t = 0; t < 2 && tables[t]; t++) {
+        cost += tables[t]->cost;
+        stats->table_bytes += sizeof(struct hashmap) 
+                              + 2 * (tables[t]->cap + PSL_MAX + GROUP)
+                              + WORDS(tables[t]->cap + PSL_MAX) * sizeof(uint64_t);
+        stats->entry_bytes += (tables[t]->cap + PSL_MAX) * sizeof(struct entry);
+
+        /* psl 0, 1, 2-3, 4-7, ... */
+        for (int i = used(tables[t], 0); i < tables[t]->cap + PSL_MAX; i = used(tables[t], i + 1)) {
+            psl = tables[t]->psls[i] - 1;
+            stats->max_psl = max(stats->max_psl, psl);
+            for (bucket = 0; psl && bucket < MAP_HIST - 1; bucket++)
+                psl >>= 1;
+            stats->psl_hist[bucket]++;
+        }
+    }
 
-    i = map->pos;
-    cur = NULL;
+    stats->mean_psl = stats->len ? (double)cost / stats->len : 0;
 
-    while (1) {
+    for (chunk = map->keys.head; chunk; chunk = chunk->next)
+        stats->key_bytes += sizeof(struct chunk) + chunk->size;
 
-        if (i >= map->cap || i < 0)
-            break;
+    /* values live in their entries, count them once */
+    stats->value_bytes = stats->len * sizeof(uintptr_t);
+    stats->entry_bytes -= stats->value_bytes;
 
-        cur = map->entries[i];
-        if (cur != NULL)
-            break;
-        
-        i++;
-    }
+    stats->probes = map->counters->probes;
+    stats->compares = map->counters->compares;
+    stats->resizes = map->counters->resizes;
+    stats->backshifts = map->counters->backshifts;
+}
 
-    if (cur == NULL) {
-        map->pos = -1;
-    } else {
-        map->pos = i;
+/*********************************************************************
+ *                                                                   *
+ *                             iteration                             *
+ *                                                                   *
+ *********************************************************************/
+
+/********
+ * seek *
+ ********/
+
+/* 
+ * the first index, from i on, with an entry, or -1.  indices past the 
+ * current table's slots continue into the old table while rehashing 
+ */
+
+static int
+seek(const struct hashmap* map, int i)
+{
+    int n;
+
+    n = map->cap + PSL_MAX;
+
+    if (i < n)
+        i = used(map, i);
+
+    if (i >= n && map->old) {
+        i = n + used(map->old, i - n);
+        n += map->old->cap + PSL_MAX;
     }
+
+    return i < n ? i : -1;
+}
+
+/************
+ * entry_at *
+ ************/
+
+/* the entry at an index from seek */
+
+static struct entry*
+entry_at(const struct hashmap* map, int i)
+{
+    if (i < map->cap + PSL_MAX)
+        return &map->entries[i];
+
+    return &map->old->entries[i - map->cap - PSL_MAX];
+}
+
+/************
+ * map_next *
+ ************/
+
+/* moves pos past the current entry to the next one */
+
+void
+map_next(struct hashmap* map)
+{
+    if (map->pos >= 0)
+        map->pos = seek(map, map->pos + 1);
 }
 
 /*************
@@ -519,8 +2091,7 @@ map_next(struct hashmap* map)
 void 
 map_begin(struct hashmap* map)
 {
-    map->pos = 0;
-    map_next(map);
+    map->pos = seek(map, 0);
 }
 
 /***********
@@ -539,14 +2110,189 @@ map_end(struct hashmap* map)
  * map_cur *
  ***********/
 
-/* copies key and val at current entry */
+/* copies key, including its nul terminator, and val at current entry */
 
 void 
 map_cur(struct hashmap* map, char* key, uintptr_t* val)
 {
     struct entry* cur;
 
-    cur = map->entries[map->pos];
-    strcpy(key, cur->key);
+    cur = entry_at(map, map->pos);
+    memcpy(key, entry_key(cur), entry_len(cur) + 1);
+    *val = cur->val;
+}
+
+/***************
+ * map_cur_ref *
+ ***************/
+
+/* 
+ * points key at the current entry's own nul terminated key, of len bytes, and
+ * val at its value.  nothing is copied, the pointers are good until the map
+ * is next modified.
+ */
+
+void
+map_cur_ref(struct hashmap* map, const char** key, size_t* len, uintptr_t** val)
+{
+    struct entry* cur;
+
+    cur = entry_at(map, map->pos);
+    *key = entry_key(cur);
+    *len = entry_len(cur);
+    *val = &cur->val;
+}
+
+/*****************
+ * map_iter_init *
+ *****************/
+
+/* 
+ * starts a traversal owned by the caller.  the map is only read, so any 
+ * number of iterators may walk it at once, as long as nothing modifies it
+ */
+
+void
+map_iter_init(struct map_iter* it, const struct hashmap* map)
+{
+    it->map = map;
+    it->pos = 0;
+}
+
+/*****************
+ * map_iter_next *
+ *****************/
+
+/* copies key, including its nul terminator, and val of the next entry, 0 once done */
+
+int
+map_iter_next(struct map_iter* it, char* key, uintptr_t* val)
+{
+    struct entry* cur;
+    int i;
+
+    if (it->pos < 0 || (i = seek(it->map, it->pos)) < 0) {
+        it->pos = -1;
+        return 0;
+    }
+
+    cur = entry_at(it->map, i);
+    memcpy(key, entry_key(cur), entry_len(cur) + 1);
     *val = cur->val;
-}
\ No newline at end of file
+    it->pos = i + 1;
+
+    return 1;
+}
+
+/*********************
+ * map_iter_next_ref *
+ *********************/
+
+/* map_iter_next without the copy, key, len and val as for map_cur_ref */
+
+int
+map_iter_next_ref(struct map_iter* it, const char** key, size_t* len, uintptr_t** val)
+{
+    struct entry* cur;
+    int i;
+
+    if (it->pos < 0 || (i = seek(it->map, it->pos)) < 0) {
+        it->pos = -1;
+        return 0;
+    }
+
+    cur = entry_at(it->map, i);
+    *key = entry_key(cur);
+    *len = entry_len(cur);
+    *val = &cur->val;
+    it->pos = i + 1;
+
+    return 1;
+}
+
+/*************
+ * map_slots *
+ *************/
+
+/* size of the slot index space iterated by map_for_each_range, old table included */
+
+int
+map_slots(const struct hashmap* map)
+{
+    return map->cap + PSL_MAX + (map->old ? map->old->cap + PSL_MAX : 0);
+}
+
+/*************
+ * map_split *
+ *************/
+
+/* 
+ * cuts [0, map_slots(map)) into n ranges, range i being [bounds[i], bounds[i + 1]).
+ * bounds holds n + 1 ints.  ranges start on a bitmap word where possible.
+ */
+
+void
+map_split(const struct hashmap* map, int n, int* bounds)
+{
+    int slots;
+
+    slots = map_slots(map);
+
+    for (int i = 0; i < n; i++)
+        bounds[i] = (int)((int64_t)slots * i / n) & ~63;
+
+    bounds[n] = slots;
+}
+
+/**********************
+ * map_for_each_range *
+ **********************/
+
+/* 
+ * calls fn on each entry in slots [begin, end), stopping early when fn
+ * returns nonzero, which is then returned.  the map is only read, so
+ * disjoint ranges can be walked by different threads at once.
+ */
+
+int
+map_for_each_range(const struct hashmap* map, int begin, int end,
+                   int (*fn)(const char* key, uintptr_t* val, void* ctx), void* ctx)
+{
+    const struct hashmap* table;
+    struct entry* entry;
+    int base, n, stop;
+
+    table = map;
+    base = 0;
+
+    while (table && begin < end) {
+        n = table->cap + PSL_MAX;
+
+        for (int i = used(table, begin - base); i < n && base + i < end; i = used(table, i + 1)) {
+            entry = &table->entries[i];
+            stop = fn(entry_key(entry), &entry->val, ctx);
+            if (stop)
+                return stop;
+        }
+
+        /* on into the old table */
+        base += n;
+        begin = max(begin, base);
+        table = table == map ? map->old : 0;
+    }
+
+    return 0;
+}
+
+/***************
+ * map_foreach *
+ ***************/
+
+/* calls fn on every entry, straight over the slot arrays, stopping as map_for_each_range does */
+
+int
+map_foreach(const struct hashmap* map, 
+            int (*fn)(const char* key, uintptr_t* val, void* ctx), void* ctx)
+{
+    return map_for_each_range(map, 0, map_slots(map), fn, ctx);
+}
@@ -1,29 +1,106 @@
 #ifndef MAP_H
 #define MAP_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define MAP_ENOENTRY -30
+#define MAP_ECOLLIDE -31   /* too many keys share a hash to place another */
+
+/* map_alloc_ex flags */
+
+#define MAP_POW2 1          /* power of two capacities, fibonacci hashing instead of % prime */
+#define MAP_INCREMENTAL 2   /* spread each resize over the following puts and dels */
 
 struct hashmap;
 
+/* caller owned iterator, see map_iter_init */
+
+struct map_iter {
+    const struct hashmap* map;
+    int pos;                /* slot to resume from, -1 once done */
+};
+
+/* filled in by map_stats */
+
+#define MAP_HIST 8          /* psl histogram buckets, 0, 1, 2-3, 4-7, ..., 64+ */
+
+struct map_stats {
+    int len;
+    int cap;
+    double load;
+    double mean_psl;
+    int max_psl;
+    int psl_hist[MAP_HIST];
+    size_t table_bytes;     /* control bytes, occupancy bitmaps and map structs */
+    size_t entry_bytes;     /* slot arrays, less value_bytes */
+    size_t key_bytes;       /* key arena, short keys live in the entries */
+    size_t value_bytes;     /* values of the entries, the four sum to the map's memory */
+    uint64_t probes;        /* cumulative, 0 unless map.c is built with MAP_STATS */
+    uint64_t compares;
+    uint64_t resizes;
+    uint64_t backshifts;
+};
+
 /* constructor / destructors */
 
 struct hashmap* map_alloc(int cap, void (*val_free)(void*));
+struct hashmap* map_alloc_ex(int cap, void (*val_free)(void*), 
+                             uint64_t (*hash)(const void* key, size_t len), int flags);
 void map_free(struct hashmap* map);
 
+/* hash functions for map_alloc_ex, map_alloc uses wyhash */
+
+uint64_t map_hash_wyhash(const void* key, size_t len);
+uint64_t map_hash_djb2(const void* key, size_t len);
+
 /* insertion */
 
-void map_put(struct hashmap* map, char* key, uintptr_t val);
+int map_put(struct hashmap* map, char* key, uintptr_t val);
 int map_set(struct hashmap* map, char* key, uintptr_t val);
+uintptr_t* map_upsert(struct hashmap* map, char* key, int* inserted);
+
+/* presizing and bulk loading */
+
+void map_reserve(struct hashmap* map, int n);
+int map_build(struct hashmap* map, char** keys, uintptr_t* vals, int n);
+
+/* batches, hashed and prefetched ahead, resized once */
+
+int map_put_batch(struct hashmap* map, char** keys, uintptr_t* vals, int n);
+int map_del_batch(struct hashmap* map, char** keys, int n);
+
+/* length delimited keys, may contain zero bytes */
+
+int map_put_n(struct hashmap* map, const void* key, size_t len, uintptr_t val);
+int map_set_n(struct hashmap* map, const void* key, size_t len, uintptr_t val);
+uintptr_t* map_upsert_n(struct hashmap* map, const void* key, size_t len, int* inserted);
 
 /* deletion */
 
 int map_del(struct hashmap* map, char* key);
+int map_del_n(struct hashmap* map, const void* key, size_t len);
 
 /* retreival */
 
 int map_get(struct hashmap* map, char* key, uintptr_t* res);
+int map_get_n(struct hashmap* map, const void* key, size_t len, uintptr_t* res);
+int map_get_batch(struct hashmap* map, char** keys, int n, uintptr_t* results, int* found);
+
+/* 
+ * precomputed hashes, h = map_hash(map, key, len).  a hash may be reused 
+ * with any map built with the same hash function
+ */
+
+uint64_t map_hash(struct hashmap* map, const void* key, size_t len);
+int map_put_h(struct hashmap* map, const void* key, size_t len, uint64_t h, uintptr_t val);
+int map_set_h(struct hashmap* map, const void* key, size_t len, uint64_t h, uintptr_t val);
+int map_del_h(struct hashmap* map, const void* key, size_t len, uint64_t h);
+int map_get_h(struct hashmap* map, const void* key, size_t len, uint64_t h, uintptr_t* res);
+
+/* introspection */
+
+void map_stats(struct hashmap* map, struct map_stats* stats);
 
 /* iteration */
 
@@ -32,15 +109,83 @@ int map_end(struct hashmap* map);
 void map_cur(struct hashmap* map, char* key, uintptr_t* val);
 void map_next(struct hashmap* map);
 
+/* 
+ * map_cur copies into key, which must fit the longest key and its nul.
+ * map_cur_ref copies nothing, pointing into the map instead
+ */
+
+void map_cur_ref(struct hashmap* map, const char** key, size_t* len, uintptr_t** val);
+
 /*
 map_begin(map); 
 while (!map_end(map)) {
-    char key[10];
-    uintptr_t val;
-    map_cur(map, key, &val);
+    const char* key;
+    size_t len;
+    uintptr_t* val;
+    map_cur_ref(map, &key, &len, &val);
     ...
     map_next(map);
 }
 */
 
+/* independent iterators over a map that is not being modified */
+
+void map_iter_init(struct map_iter* it, const struct hashmap* map);
+int map_iter_next(struct map_iter* it, char* key, uintptr_t* val);
+int map_iter_next_ref(struct map_iter* it, const char** key, size_t* len, uintptr_t** val);
+
+/*
+struct map_iter it;
+const char* key;
+size_t len;
+uintptr_t* val;
+
+map_iter_init(&it, map);
+while (map_iter_next_ref(&it, &key, &len, &val)) {
+    ...
+}
+*/
+
+/* 
+ * ranges of slots, for splitting a scan of a map that is not being modified 
+ * across threads.  fn returning nonzero stops the scan.
+ */
+
+int map_slots(const struct hashmap* map);
+void map_split(const struct hashmap* map, int n, int* bounds);
+int map_for_each_range(const struct hashmap* map, int begin, int end,
+                       int (*fn)(const char* key, uintptr_t* val, void* ctx), void* ctx);
+
+/*
+int bounds[9];
+
+map_split(map, 8, bounds);
+for each thread i of 8
+    map_for_each_range(map, bounds[i], bounds[i + 1], fn, ctx[i]);
+*/
+
+/* every entry, fn returning nonzero stops the walk and is returned */
+
+int map_foreach(const struct hashmap* map, 
+                int (*fn)(const char* key, uintptr_t* val, void* ctx), void* ctx);
+
+/* 
+ * loop form, one call per entry and no callback.  key, len and val are 
+ * lvalues of the types map_iter_next_ref fills in, break leaves early.
+ */
+
+#define MAP_FOREACH(map, key, len, val) \
+    for (struct map_iter map_it_ = { (map), 0 }; \
+         map_iter_next_ref(&map_it_, &(key), &(len), &(val)); )
+
+/*
+const char* key;
+size_t len;
+uintptr_t* val;
+
+MAP_FOREACH(map, key, len, val) {
+    ...
+}
+*/
+
 #endif    /* MAP_H */
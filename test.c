@@ -1,3 +1,5 @@
+#define MAP_STATS
+
 #include "map.c"
 #include "unity.h"
 
@@ -82,6 +84,41 @@ tree_eq(struct tree* a, struct tree* b)
  *                                                                   *
  *********************************************************************/
 
+/************
+ * is_prime *
+ ************/
+
+/* 1 if prime, 0 if not */
+
+int
+is_prime(int n)
+{
+    if (n <= 1)
+        return 0;
+    
+    if (n == 2 || n == 3)
+        return 1;
+    
+    if (n % 2 == 0 || n % 3 == 0)
+        return 0;
+    
+    for (int i = 5; i * i <= n; i = i + 6)
+        if (n % i == 0 || n % (i + 2) == 0)
+            return 0;
+ 
+    return 1;
+}
+
+/**********
+ * psl_at *
+ **********/
+
+int
+psl_at(struct hashmap* map, int idx)
+{
+    return map->psls[idx] - 1;
+}
+
 /**************
  * map_put_at *
  **************/
@@ -89,33 +126,46 @@ tree_eq(struct tree* a, struct tree* b)
 void
 map_put_at(struct hashmap* map, char* key, uintptr_t val, int idx) 
 {
-    struct entry *new, *old;
+    struct entry new, tmp;
+    uint8_t tag, old;
+    int psl;
 
-    new = entry_alloc(key, val);
+    entry_init(map, &new, key, strlen(key), val, map->hash(key, strlen(key)));
+    tag = TAG(map->hash(key, strlen(key)));
+    psl = 1;
 
     /* probe routine */
     while (1) {
-        
-        old = map->entries[idx];
 
         /* empty slot */
-        if (old == 0) {
+        if (map->psls[idx] == 0) {
             break;        
         }
 
         /* swap */
-        if (old->psl < new->psl) {
+        if (map->psls[idx] < psl) {
+            tmp = map->entries[idx];
             map->entries[idx] = new;
-            new = old;
+            map->maxpsl = max(map->maxpsl, psl - 1);
+            new = tmp;
+            old = map->tags[idx];
+            map->tags[idx] = tag;
+            tag = old;
+            old = map->psls[idx];
+            map->psls[idx] = psl;
+            psl = old;
         }
 
         idx++;
-        new->psl++;
+        psl++;
         map->cost++;
     }
 
-    map->maxpsl = max(map->maxpsl, new->psl);
+    map->maxpsl = max(map->maxpsl, psl - 1);
     map->entries[idx] = new;
+    map->psls[idx] = psl;
+    map->tags[idx] = tag;
+    SET(map->used, idx);
     map->len++;
 }
 
@@ -128,20 +178,16 @@ map_put_at(struct hashmap* map, char* key, uintptr_t val, int idx)
 void
 map_put_psl(struct hashmap* map, char* key, uintptr_t val, int psl, int idx) 
 {
-    struct entry *new, *old;
-
-    new = entry_alloc(key, val);
-    new->psl = psl;
-    
-    old = map->entries[idx];
-
-    if (old) {
-        map->cost -= old->psl;
+    if (map->psls[idx]) {
+        map->cost -= map->psls[idx] - 1;
         map->len--;
-        entry_free(old, map->val_free);
+        entry_free(map, &map->entries[idx]);
     }
 
-    map->entries[idx] = new;
+    entry_init(map, &map->entries[idx], key, strlen(key), val, map->hash(key, strlen(key)));
+    map->psls[idx] = psl + 1;
+    map->tags[idx] = TAG(map->hash(key, strlen(key)));
+    SET(map->used, idx);
     map->len++;
     map->cost += psl;
 
@@ -157,45 +203,33 @@ map_put_psl(struct hashmap* map, char* key, uintptr_t val, int psl, int idx)
 int
 map_del_at(struct hashmap* map, int idx)
 {
-    struct entry* entry;
-
     /* key not in map */
     if (idx == -1)
         return 0;
 
     /* remove key from map */
 
-    entry = map->entries[idx];
-    map->entries[idx] = 0;
-    map->cost -= entry->psl;
-
-    entry_free(entry, map->val_free);
+    entry_free(map, &map->entries[idx]);
+    map->cost -= map->psls[idx] - 1;
+    map->psls[idx] = 0;
+    map->tags[idx] = 0;
 
     map->len--;
     idx++;   
 
     /* back-shift routine */
 
-    while (1) {
-        entry = map->entries[idx];
-        
-        /* not sure what to do here*/
-        if (idx >= map->cap)
-            break;
-
-        if (entry == 0)
-            break;
-        
-        /* leave my brother */
-        if (entry->psl <= 0)
-            break;
-
-        entry->psl--;
+    while (idx < map->cap + PSL_MAX && map->psls[idx] > 1) {
+        map->entries[idx - 1] = map->entries[idx];
+        map->psls[idx - 1] = map->psls[idx] - 1;
+        map->tags[idx - 1] = map->tags[idx];
+        map->psls[idx] = 0;
+        map->tags[idx] = 0;
         map->cost--;
-        map->entries[idx - 1] = entry;
-        map->entries[idx] = 0;
         idx++;
     }
+
+    CLEAR(map->used, idx - 1);
     
     return 1;    
 }
@@ -264,7 +298,63 @@ basic_put()
     TEST_ASSERT_EQUAL_INT(3, (int)res);
 
     status = map_get(map, "harold", &res);
-    TEST_ASSERT_EQUAL_INT(EMAPNOENTRY, status);
+    TEST_ASSERT_EQUAL_INT(MAP_ENOENTRY, status);
+
+    map_free(map);
+}
+
+/***************
+ * basic_put_n *
+ ***************/
+
+void
+basic_put_n()
+{
+    struct hashmap* map;
+    uintptr_t res;
+    int status;
+
+    map = map_alloc(10, 0);
+
+    /* zero bytes are part of the key */
+    map_put_n(map, "ab\0c", 4, 1);
+    map_put_n(map, "ab\0d", 4, 2);
+    map_put_n(map, "ab", 2, 3);
+
+    status = map_get_n(map, "ab\0c", 4, &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(1, (int)res);
+
+    status = map_get_n(map, "ab\0d", 4, &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(2, (int)res);
+
+    status = map_get(map, "ab", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(3, (int)res);
+
+    /* slices need not be nul terminated */
+    status = map_get_n(map, "abc", 2, &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(3, (int)res);
+
+    status = map_get_n(map, "ab\0", 3, &res);
+    TEST_ASSERT_EQUAL_INT(MAP_ENOENTRY, status);
+
+    status = map_set_n(map, "ab\0d", 4, 4);
+    TEST_ASSERT_EQUAL_INT(0, status);
+
+    status = map_del_n(map, "ab\0c", 4);
+    TEST_ASSERT_EQUAL_INT(0, status);
+
+    status = map_get_n(map, "ab\0c", 4, &res);
+    TEST_ASSERT_EQUAL_INT(MAP_ENOENTRY, status);
+
+    status = map_get_n(map, "ab\0d", 4, &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(4, (int)res);
+
+    TEST_ASSERT_EQUAL_INT(2, map->len);
 
     map_free(map);
 }
@@ -305,17 +395,17 @@ basic_probe()
      *                                     *
      ***************************************/
     
-    TEST_ASSERT_EQUAL_STRING("brian", map->entries[0]->key);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[0]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[0]->psl);
+    TEST_ASSERT_EQUAL_STRING("brian", entry_key(&map->entries[0]));
+    TEST_ASSERT_EQUAL_INT(1, map->entries[0].val);
+    TEST_ASSERT_EQUAL_INT(0, psl_at(map, 0));
 
-    TEST_ASSERT_EQUAL_STRING("dennis", map->entries[1]->key);
-    TEST_ASSERT_EQUAL_INT(2, map->entries[1]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[1]->psl);
+    TEST_ASSERT_EQUAL_STRING("dennis", entry_key(&map->entries[1]));
+    TEST_ASSERT_EQUAL_INT(2, map->entries[1].val);
+    TEST_ASSERT_EQUAL_INT(0, psl_at(map, 1));
 
-    TEST_ASSERT_EQUAL_STRING("alfred", map->entries[2]->key);
-    TEST_ASSERT_EQUAL_INT(3, map->entries[2]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[2]->psl);
+    TEST_ASSERT_EQUAL_STRING("alfred", entry_key(&map->entries[2]));
+    TEST_ASSERT_EQUAL_INT(3, map->entries[2].val);
+    TEST_ASSERT_EQUAL_INT(0, psl_at(map, 2));
 
     TEST_ASSERT_EQUAL_INT(0, map->cost);
 
@@ -340,21 +430,21 @@ basic_probe()
      *                                     *
      ***************************************/
     
-    TEST_ASSERT_EQUAL_STRING("brian", map->entries[0]->key);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[0]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[0]->psl);
+    TEST_ASSERT_EQUAL_STRING("brian", entry_key(&map->entries[0]));
+    TEST_ASSERT_EQUAL_INT(1, map->entries[0].val);
+    TEST_ASSERT_EQUAL_INT(0, psl_at(map, 0));
 
-    TEST_ASSERT_EQUAL_STRING("harold", map->entries[1]->key);
-    TEST_ASSERT_EQUAL_INT(4, map->entries[1]->val);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[1]->psl);
+    TEST_ASSERT_EQUAL_STRING("harold", entry_key(&map->entries[1]));
+    TEST_ASSERT_EQUAL_INT(4, map->entries[1].val);
+    TEST_ASSERT_EQUAL_INT(1, psl_at(map, 1));
 
-    TEST_ASSERT_EQUAL_STRING("dennis", map->entries[2]->key);
-    TEST_ASSERT_EQUAL_INT(2, map->entries[2]->val);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[2]->psl);
+    TEST_ASSERT_EQUAL_STRING("dennis", entry_key(&map->entries[2]));
+    TEST_ASSERT_EQUAL_INT(2, map->entries[2].val);
+    TEST_ASSERT_EQUAL_INT(1, psl_at(map, 2));
 
-    TEST_ASSERT_EQUAL_STRING("alfred", map->entries[3]->key);
-    TEST_ASSERT_EQUAL_INT(3, map->entries[3]->val);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[3]->psl);
+    TEST_ASSERT_EQUAL_STRING("alfred", entry_key(&map->entries[3]));
+    TEST_ASSERT_EQUAL_INT(3, map->entries[3].val);
+    TEST_ASSERT_EQUAL_INT(1, psl_at(map, 3));
 
     TEST_ASSERT_EQUAL_INT(3, map->cost);
 
@@ -419,17 +509,17 @@ basic_del()
      ***************************************/
 
     TEST_ASSERT_EQUAL_INT(1, status);
-    TEST_ASSERT_EQUAL_STRING("brian", map->entries[0]->key);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[0]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[0]->psl);
+    TEST_ASSERT_EQUAL_STRING("brian", entry_key(&map->entries[0]));
+    TEST_ASSERT_EQUAL_INT(1, map->entries[0].val);
+    TEST_ASSERT_EQUAL_INT(0, psl_at(map, 0));
 
-    TEST_ASSERT_EQUAL_STRING("dennis", map->entries[1]->key);
-    TEST_ASSERT_EQUAL_INT(2, map->entries[1]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[1]->psl);
+    TEST_ASSERT_EQUAL_STRING("dennis", entry_key(&map->entries[1]));
+    TEST_ASSERT_EQUAL_INT(2, map->entries[1].val);
+    TEST_ASSERT_EQUAL_INT(0, psl_at(map, 1));
 
-    TEST_ASSERT_EQUAL_STRING("alfred", map->entries[2]->key);
-    TEST_ASSERT_EQUAL_INT(3, map->entries[2]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[2]->psl);
+    TEST_ASSERT_EQUAL_STRING("alfred", entry_key(&map->entries[2]));
+    TEST_ASSERT_EQUAL_INT(3, map->entries[2].val);
+    TEST_ASSERT_EQUAL_INT(0, psl_at(map, 2));
 
     TEST_ASSERT_EQUAL_INT(0, map->cost);
 
@@ -444,6 +534,8 @@ void
 basic_grow()
 {
     struct hashmap* map;
+    uintptr_t res;
+    int status;
 
     map = map_alloc(5, 0);
 
@@ -456,28 +548,19 @@ basic_grow()
     TEST_ASSERT_EQUAL_INT(11, map->cap);
     TEST_ASSERT_EQUAL_INT(3, map->len);
 
-    TEST_ASSERT_EQUAL_STRING("brian", map->entries[0]->key);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[0]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[0]->psl);
-
-    TEST_ASSERT_EQUAL_STRING("dennis", map->entries[1]->key);
-    TEST_ASSERT_EQUAL_INT(2, map->entries[1]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[1]->psl);
+    /* entries are redistributed to their homes in the new table */
 
-    TEST_ASSERT_EQUAL_STRING("alfred", map->entries[2]->key);
-    TEST_ASSERT_EQUAL_INT(3, map->entries[2]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[2]->psl);
+    status = map_get(map, "brian", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(1, (int)res);
 
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[3]);
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[4]);
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[5]);
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[6]);
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[7]);
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[8]);
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[9]);
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[10]);
+    status = map_get(map, "dennis", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(2, (int)res);
 
-    TEST_ASSERT_EQUAL_INT(0, map->cost);
+    status = map_get(map, "alfred", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(3, (int)res);
 
     map_free(map);
 }
@@ -490,6 +573,8 @@ void
 basic_shrink()
 {
     struct hashmap* map;
+    uintptr_t res;
+    int status;
 
     map = map_alloc(13, 0);
 
@@ -501,25 +586,107 @@ basic_shrink()
     TEST_ASSERT_EQUAL_INT(7, map->cap);
     TEST_ASSERT_EQUAL_INT(2, map->len);
 
-    TEST_ASSERT_EQUAL_STRING("brian", map->entries[0]->key);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[0]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[0]->psl);
+    status = map_get(map, "brian", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(1, (int)res);
+
+    status = map_get(map, "dennis", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(2, (int)res);
 
-    TEST_ASSERT_EQUAL_STRING("dennis", map->entries[1]->key);
-    TEST_ASSERT_EQUAL_INT(2, map->entries[1]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[1]->psl);
+    map_free(map);
+}
 
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[2]);
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[3]);
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[4]);
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[5]);
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[6]);
 
-    TEST_ASSERT_EQUAL_INT(0, map->cost);
+/**************
+ * basic_pow2 *
+ **************/
+
+void
+basic_pow2()
+{
+    struct hashmap* map;
+    uintptr_t res;
+    int status;
+
+    map = map_alloc_ex(5, 0, 0, MAP_POW2);
+
+    TEST_ASSERT_EQUAL_INT(8, map->cap);
+    TEST_ASSERT_EQUAL_INT(61, map->shift);
+
+    map_put(map, "brian", 1);
+    map_put(map, "dennis", 2);
+    map_put(map, "alfred", 3);
+    map_put(map, "jeffrey", 4);
+    map_put(map, "harold", 5);
+    map_put(map, "ken", 6);
+
+    TEST_ASSERT_EQUAL_INT(16, map->cap);
+    TEST_ASSERT_EQUAL_INT(60, map->shift);
+
+    status = map_get(map, "brian", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(1, (int)res);
+
+    status = map_get(map, "ken", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(6, (int)res);
 
     map_free(map);
 }
 
+/*********************
+ * basic_incremental *
+ *********************/
+
+void
+basic_incremental()
+{
+    struct hashmap* map;
+    char key[16];
+    uintptr_t res;
+    int status, left;
+
+    map = map_alloc_ex(11, 0, 0, MAP_INCREMENTAL);
+
+    for (int i = 0; i < 8; i++) {
+        sprintf(key, "user:%06d", i);
+        map_put(map, key, i);
+    }
+
+    /* the grow only swapped tables, nothing moved yet */
+    TEST_ASSERT_EQUAL_INT(29, map->cap);
+    TEST_ASSERT_NOT_NULL(map->old);
+    TEST_ASSERT_EQUAL_INT(11, map->old->cap);
+    TEST_ASSERT_EQUAL_INT(8, map->old->len);
+    TEST_ASSERT_EQUAL_INT(0, map->len);
+
+    /* lookups see both tables */
+    for (int i = 0; i < 8; i++) {
+        sprintf(key, "user:%06d", i);
+        status = map_get(map, key, &res);
+        TEST_ASSERT_EQUAL_INT(0, status);
+        TEST_ASSERT_EQUAL_INT(i, (int)res);
+    }
+
+    /* each operation moves a bounded amount */
+    for (int i = 8; map->old; i++) {
+        left = map->old->len;
+        sprintf(key, "user:%06d", i);
+        map_put(map, key, i);
+        if (map->old)
+            TEST_ASSERT_TRUE(left - map->old->len <= MIGRATE_STEP);
+    }
+
+    for (int i = 0; i < map->len; i++) {
+        sprintf(key, "user:%06d", i);
+        status = map_get(map, key, &res);
+        TEST_ASSERT_EQUAL_INT(0, status);
+        TEST_ASSERT_EQUAL_INT(i, (int)res);
+    }
+
+    map_free(map);
+}
 
 /*********************************************************************
  *                                                                   *
@@ -563,17 +730,140 @@ basic_shrink()
     TEST_ASSERT_EQUAL_INT(2, next_prime(2));
     TEST_ASSERT_EQUAL_INT(11, next_prime(9));
     TEST_ASSERT_EQUAL_INT(11, next_prime(11));
-    TEST_ASSERT_EQUAL_INT(131, next_prime(130));
-    TEST_ASSERT_EQUAL_INT(383, next_prime(380));
-    TEST_ASSERT_EQUAL_INT(7817, next_prime(7794));
+    TEST_ASSERT_EQUAL_INT(193, next_prime(130));
+    TEST_ASSERT_EQUAL_INT(389, next_prime(380));
+    TEST_ASSERT_EQUAL_INT(12289, next_prime(7794));
  }
 
+/*********************
+ * check_prime_table *
+ *********************/
+
+void
+check_prime_table()
+{
+    uint32_t a;
+
+    for (int i = 0; i < NPRIMES; i++) {
+        TEST_ASSERT_TRUE(is_prime(primes[i].prime));
+        if (i > 0)
+            TEST_ASSERT_TRUE(primes[i].prime > primes[i - 1].prime);
+        TEST_ASSERT_EQUAL_UINT64(primes[i].magic, prime_magic(primes[i].prime));
+
+        /* fastmod agrees with % */
+        for (int j = 0; j < 1000; j++) {
+            a = j * 2654435761u;
+            TEST_ASSERT_EQUAL_UINT32(a % primes[i].prime, 
+                                     fastmod(a, primes[i].magic, primes[i].prime));
+        }
+
+        TEST_ASSERT_EQUAL_UINT32(UINT32_MAX % primes[i].prime, 
+                                 fastmod(UINT32_MAX, primes[i].magic, primes[i].prime));
+    }
+
+    /* capacities off the table get their multiplier computed */
+    TEST_ASSERT_EQUAL_UINT32(12345 % 10, fastmod(12345, prime_magic(10), 10));
+}
+
+/**********************
+ * check_shrink_prime *
+ **********************/
+
+/* halving a table prime must not round back up to the same prime */
+
+void
+check_shrink_prime()
+{
+    struct hashmap* map;
+
+    map = map_alloc(389, 0);
+    map_put(map, "brian", 1);
+
+    shrink(map);
+    TEST_ASSERT_EQUAL_INT(193, map->cap);
+
+    shrink(map);
+    TEST_ASSERT_EQUAL_INT(97, map->cap);
+
+    map_free(map);
+}
+
+/**************
+ * check_hash *
+ **************/
+
+void
+check_hash()
+{
+    struct hashmap* map;
+    uintptr_t res;
+    int status;
+
+    TEST_ASSERT_EQUAL_UINT64(5381, map_hash_djb2("", 0));
+    TEST_ASSERT_EQUAL_UINT64(177670, map_hash_djb2("a", 1));
+    TEST_ASSERT_EQUAL_UINT64(map_hash_djb2("ab", 2), map_hash_djb2("abc", 2));
+
+    TEST_ASSERT_EQUAL_UINT64(map_hash_wyhash("user:000123", 11), 
+                             map_hash_wyhash("user:000123", 11));
+    TEST_ASSERT_TRUE(map_hash_wyhash("user:000123", 11) 
+                     != map_hash_wyhash("user:000124", 11));
+    TEST_ASSERT_TRUE(map_hash_wyhash("", 0) != map_hash_wyhash("\0", 1));
+
+    map = map_alloc_ex(10, 0, map_hash_djb2, 0);
+
+    map_put(map, "brian", 1);
+    map_put(map, "dennis", 2);
+
+    TEST_ASSERT_EQUAL_UINT64(map_hash_djb2("brian", 5), 
+                             map->entries[find(map, "brian", 5, map_hash_djb2("brian", 5))].hash);
+
+    status = map_get(map, "dennis", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(2, (int)res);
+
+    map_free(map);
+}
+
 /*********************************************************************
  *                                                                   *
  *                          probing tests                            *
  *                                                                   *
  *********************************************************************/
 
+/***************
+ * basic_build *
+ ***************/
+
+void
+basic_build()
+{
+    struct hashmap* map;
+    char* keys[] = { "ken", "dennis", "brian", "dennis" };
+    uintptr_t vals[] = { 1, 2, 3, 4 };
+    uintptr_t res;
+    int status;
+
+    map = map_alloc(5, 0);
+    map_build(map, keys, vals, 4);
+
+    TEST_ASSERT_EQUAL_INT(3, map->len);
+
+    status = map_get(map, "ken", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(1, (int)res);
+
+    /* the last of a repeated key wins */
+    status = map_get(map, "dennis", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(4, (int)res);
+
+    status = map_get(map, "brian", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(3, (int)res);
+
+    map_free(map);
+}
+
 /*********************
  * check_tree_values *
  *********************/
@@ -692,27 +982,27 @@ check_probe()
      *                          *
      ****************************/
 
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[0]);
+    TEST_ASSERT_EQUAL_INT(0, map->psls[0]);
     
-    TEST_ASSERT_EQUAL_INT(43, map->entries[1]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[1]->psl);
+    TEST_ASSERT_EQUAL_INT(43, map->entries[1].val);
+    TEST_ASSERT_EQUAL_INT(0, psl_at(map, 1));
 
-    TEST_ASSERT_EQUAL_INT(17, map->entries[2]->val);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[2]->psl);
+    TEST_ASSERT_EQUAL_INT(17, map->entries[2].val);
+    TEST_ASSERT_EQUAL_INT(1, psl_at(map, 2));
 
-    TEST_ASSERT_EQUAL_INT(31, map->entries[3]->val);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[3]->psl);
+    TEST_ASSERT_EQUAL_INT(31, map->entries[3].val);
+    TEST_ASSERT_EQUAL_INT(1, psl_at(map, 3));
 
-    TEST_ASSERT_EQUAL_INT(76, map->entries[4]->val);
-    TEST_ASSERT_EQUAL_INT(2, map->entries[4]->psl);
+    TEST_ASSERT_EQUAL_INT(76, map->entries[4].val);
+    TEST_ASSERT_EQUAL_INT(2, psl_at(map, 4));
 
-    TEST_ASSERT_EQUAL_INT(28, map->entries[5]->val);
-    TEST_ASSERT_EQUAL_INT(2, map->entries[5]->psl);
+    TEST_ASSERT_EQUAL_INT(28, map->entries[5].val);
+    TEST_ASSERT_EQUAL_INT(2, psl_at(map, 5));
 
-    TEST_ASSERT_EQUAL_INT(10, map->entries[6]->val);
-    TEST_ASSERT_EQUAL_INT(3, map->entries[6]->psl);
+    TEST_ASSERT_EQUAL_INT(10, map->entries[6].val);
+    TEST_ASSERT_EQUAL_INT(3, psl_at(map, 6));
 
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[7]);
+    TEST_ASSERT_EQUAL_INT(0, map->psls[7]);
 
     TEST_ASSERT_EQUAL_INT(9, map->cost);
     TEST_ASSERT_EQUAL_INT(3, map->maxpsl);
@@ -791,32 +1081,1242 @@ check_del()
      *                          *
      ****************************/
 
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[0]);
+    TEST_ASSERT_EQUAL_INT(0, map->psls[0]);
     
-    TEST_ASSERT_EQUAL_INT(48, map->entries[1]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[1]->psl);
+    TEST_ASSERT_EQUAL_INT(48, map->entries[1].val);
+    TEST_ASSERT_EQUAL_INT(0, psl_at(map, 1));
 
-    TEST_ASSERT_EQUAL_INT(33, map->entries[2]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[2]->psl);
+    TEST_ASSERT_EQUAL_INT(33, map->entries[2].val);
+    TEST_ASSERT_EQUAL_INT(0, psl_at(map, 2));
 
-    TEST_ASSERT_EQUAL_INT(19, map->entries[3]->val);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[3]->psl);
+    TEST_ASSERT_EQUAL_INT(19, map->entries[3].val);
+    TEST_ASSERT_EQUAL_INT(1, psl_at(map, 3));
 
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[4]);
+    TEST_ASSERT_EQUAL_INT(0, map->psls[4]);
 
-    TEST_ASSERT_EQUAL_INT(92, map->entries[5]->val);
-    TEST_ASSERT_EQUAL_INT(0, map->entries[5]->psl);
+    TEST_ASSERT_EQUAL_INT(92, map->entries[5].val);
+    TEST_ASSERT_EQUAL_INT(0, psl_at(map, 5));
 
-    TEST_ASSERT_EQUAL_INT(72, map->entries[6]->val);
-    TEST_ASSERT_EQUAL_INT(1, map->entries[6]->psl);
+    TEST_ASSERT_EQUAL_INT(72, map->entries[6].val);
+    TEST_ASSERT_EQUAL_INT(1, psl_at(map, 6));
 
-    TEST_ASSERT_EQUAL_PTR(0, map->entries[7]);
+    TEST_ASSERT_EQUAL_INT(0, map->psls[7]);
 
     TEST_ASSERT_EQUAL_INT(2, map->cost);
 
     map_free(map);
 }
 
+/********************
+ * check_early_exit *
+ ********************/
+
+void
+check_early_exit()
+{
+    struct hashmap* map;
+    int home;
+
+    map = map_alloc(8, 0);
+    home = reduce(map, map->hash("brian", 5));
+
+    map_put_psl(map, "alfred", 1, 0, home);
+    map_put_psl(map, "brian", 2, 1, home + 1);
+
+    TEST_ASSERT_EQUAL_INT(home + 1, find(map, "brian", 5, map->hash("brian", 5)));
+
+    /* a slot closer to its home than the probe ends the search */
+    map_put_psl(map, "dennis", 3, 0, home + 1);
+    map_put_psl(map, "harold", 4, 0, home + 2);
+    map_put_psl(map, "brian", 2, 3, home + 3);
+
+    TEST_ASSERT_EQUAL_INT(MAP_ENOENTRY, find(map, "brian", 5, map->hash("brian", 5)));
+
+    map_free(map);
+}
+
+/*********************
+ * check_group_probe *
+ *********************/
+
+void
+check_group_probe()
+{
+    struct hashmap* map;
+    int home;
+
+    map = map_alloc(64, 0);
+    home = reduce(map, map->hash("brian", 5));
+
+    /* a cluster spanning several groups, all sharing our home */
+    for (int i = 0; i < 40; i++)
+        map_put_psl(map, "", i, i, home + i);
+
+    map_put_psl(map, "brian", 40, 40, home + 40);
+
+    TEST_ASSERT_EQUAL_INT(home + 40, find(map, "brian", 5, map->hash("brian", 5)));
+
+    /* a fingerprint mismatch rules the slot out */
+    map->tags[home + 40] ^= 1;
+
+    TEST_ASSERT_EQUAL_INT(MAP_ENOENTRY, find(map, "brian", 5, map->hash("brian", 5)));
+
+    map_free(map);
+}
+
+/************
+ * put_many *
+ ************/
+
+/* fills map through several grows, then drains it through several shrinks */
+
+void
+put_many(struct hashmap* map)
+{
+    char key[16];
+    uintptr_t res;
+    int status;
+
+    /* several grows */
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "user:%06d", i);
+        map_put(map, key, i);
+    }
+
+    TEST_ASSERT_EQUAL_INT(1000, count(map));
+
+    /* several shrinks */
+    for (int i = 0; i < 1000; i += 2) {
+        sprintf(key, "user:%06d", i);
+        status = map_del(map, key);
+        TEST_ASSERT_EQUAL_INT(0, status);
+    }
+
+    for (int i = 0; i < 900; i++) {
+        sprintf(key, "user:%06d", i);
+        map_del(map, key);
+    }
+
+    TEST_ASSERT_EQUAL_INT(50, count(map));
+
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "user:%06d", i);
+        status = map_get(map, key, &res);
+        if (i % 2 == 0 || i < 900) {
+            TEST_ASSERT_EQUAL_INT(MAP_ENOENTRY, status);
+        } else {
+            TEST_ASSERT_EQUAL_INT(0, status);
+            TEST_ASSERT_EQUAL_INT(i, (int)res);
+        }
+    }
+}
+
+/**************
+ * check_many *
+ **************/
+
+void
+check_many()
+{
+    struct hashmap* map;
+
+    map = map_alloc(5, 0);
+    put_many(map);
+    map_free(map);
+}
+
+/*******************
+ * check_many_pow2 *
+ *******************/
+
+void
+check_many_pow2()
+{
+    struct hashmap* map;
+
+    map = map_alloc_ex(5, 0, 0, MAP_POW2);
+    put_many(map);
+
+    /* 50 entries, shrunk while at or below a quarter full */
+    TEST_ASSERT_EQUAL_INT(128, map->cap);
+    TEST_ASSERT_EQUAL_INT(57, map->shift);
+
+    map_free(map);
+}
+
+/**************************
+ * check_many_incremental *
+ **************************/
+
+void
+check_many_incremental()
+{
+    struct hashmap* map;
+
+    map = map_alloc_ex(5, 0, 0, MAP_INCREMENTAL | MAP_POW2);
+    put_many(map);
+    map_free(map);
+
+    map = map_alloc_ex(5, 0, 0, MAP_INCREMENTAL);
+    put_many(map);
+    map_free(map);
+}
+
+/***************
+ * check_build *
+ ***************/
+
+/* bulk load lands every entry with the same total displacement as puts */
+
+void
+check_build()
+{
+    struct hashmap *built, *put;
+    char* keys[1000];
+    uintptr_t vals[1000];
+    uintptr_t res;
+    int cap, status;
+
+    for (int i = 0; i < 1000; i++) {
+        keys[i] = malloc(16);
+        sprintf(keys[i], "user:%06d", i);
+        vals[i] = i;
+    }
+
+    built = map_alloc(5, 0);
+    map_build(built, keys, vals, 1000);
+    cap = built->cap;
+
+    /* already big enough, reserving again is a no-op */
+    map_reserve(built, 1000);
+    TEST_ASSERT_EQUAL_INT(cap, built->cap);
+
+    put = map_alloc(5, 0);
+    map_reserve(put, 1000);
+    TEST_ASSERT_EQUAL_INT(cap, put->cap);
+
+    for (int i = 0; i < 1000; i++)
+        map_put(put, keys[i], vals[i]);
+
+    /* no grows past the reserved size */
+    TEST_ASSERT_EQUAL_INT(cap, put->cap);
+    TEST_ASSERT_EQUAL_INT(1000, built->len);
+    TEST_ASSERT_EQUAL_INT(put->cost, built->cost);
+
+    for (int i = 0; i < 1000; i++) {
+        status = map_get(built, keys[i], &res);
+        TEST_ASSERT_EQUAL_INT(0, status);
+        TEST_ASSERT_EQUAL_INT(i, (int)res);
+    }
+
+    /* a map with entries takes the put path */
+    map_build(put, keys, vals, 500);
+    TEST_ASSERT_EQUAL_INT(1000, put->len);
+
+    map_free(built);
+    map_free(put);
+
+    for (int i = 0; i < 1000; i++)
+        free(keys[i]);
+}
+
+/*****************
+ * check_compact *
+ *****************/
+
+/* deleting most keys compacts the arena, the survivors move with it */
+
+void
+check_compact()
+{
+    struct hashmap* map;
+    struct chunk* chunk;
+    char key[32];
+    uintptr_t res;
+    int status, chunks;
+
+    map = map_alloc(5, 0);
+
+    for (int i = 0; i < 10000; i++) {
+        sprintf(key, "session:user:%06d", i);
+        map_put(map, key, i);
+    }
+
+    TEST_ASSERT_EQUAL_INT(10000 * RECORD(19), map->keys.live);
+    TEST_ASSERT_EQUAL_INT(0, map->keys.dead);
+
+    /* updates keep the key where it is */
+    map_set(map, "session:user:009999", 7);
+    map_put(map, "session:user:000000", 0);
+    TEST_ASSERT_EQUAL_INT(10000 * RECORD(19), map->keys.live);
+    TEST_ASSERT_EQUAL_INT(0, map->keys.dead);
+
+    for (int i = 0; i < 9000; i++) {
+        sprintf(key, "session:user:%06d", i);
+        map_del(map, key);
+    }
+
+    /* deletes only count dead bytes, the next resize compacts */
+    TEST_ASSERT_TRUE(map->keys.dead > map->keys.live);
+    TEST_ASSERT_EQUAL_INT(1000 * RECORD(19), map->keys.live);
+
+    resize(map, map->cap);
+    TEST_ASSERT_TRUE(map->keys.dead <= map->keys.live);
+    TEST_ASSERT_EQUAL_INT(1000 * RECORD(19), map->keys.live);
+
+    chunks = 0;
+    for (chunk = map->keys.head; chunk; chunk = chunk->next)
+        chunks++;
+    TEST_ASSERT_TRUE(chunks <= 2);
+
+    for (int i = 9000; i < 10000; i++) {
+        sprintf(key, "session:user:%06d", i);
+        status = map_get(map, key, &res);
+        TEST_ASSERT_EQUAL_INT(0, status);
+        TEST_ASSERT_EQUAL_INT(i == 9999 ? 7 : i, (int)res);
+    }
+
+    map_free(map);
+}
+
+/*****************
+ * check_recycle *
+ *****************/
+
+/* a deleted key's record is reused by the next key of its size */
+
+void
+check_recycle()
+{
+    struct hashmap* map;
+    char* freed;
+    size_t used;
+    uintptr_t res;
+    int status;
+
+    map = map_alloc(13, 0);
+
+    map_put(map, "brian.kernighan@bell", 1);
+    map_put(map, "dennis.ritchie@bell", 2);
+    map_put(map, "ken.thompson@bell", 3);
+
+    freed = map->entries[find(map, "brian.kernighan@bell", 20, map->hash("brian.kernighan@bell", 20))].key.out;
+    used = map->keys.head->used;
+
+    map_del(map, "brian.kernighan@bell");
+    TEST_ASSERT_EQUAL_INT(RECORD(20), map->keys.dead);
+
+    /* same record size */
+    map_put(map, "alfred.aho@bell.com", 4);
+
+    TEST_ASSERT_EQUAL_INT(0, map->keys.dead);
+    TEST_ASSERT_EQUAL_INT(used, map->keys.head->used);
+    TEST_ASSERT_TRUE(freed == map->entries[find(map, "alfred.aho@bell.com", 19, map->hash("alfred.aho@bell.com", 19))].key.out);
+
+    status = map_get(map, "alfred.aho@bell.com", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(4, (int)res);
+
+    map_free(map);
+}
+
+/****************
+ * check_inline *
+ ****************/
+
+/* keys up to INLINE bytes live in the entry, longer ones in the arena */
+
+void
+check_inline()
+{
+    struct hashmap* map;
+    struct entry* entry;
+    char key[32];
+    uintptr_t res;
+    int status;
+
+    map = map_alloc(13, 0);
+
+    map_put(map, "", 1);
+    map_put(map, "fifteen chars!!", 2);
+    map_put(map, "sixteen chars!!!", 3);
+    map_put_n(map, "nul\0inside", 10, 4);
+
+    TEST_ASSERT_EQUAL_INT(RECORD(16), map->keys.live);
+
+    entry = &map->entries[find(map, "fifteen chars!!", 15, map->hash("fifteen chars!!", 15))];
+    TEST_ASSERT_EQUAL_INT(0, entry->key.in[15]);
+    TEST_ASSERT_EQUAL_INT(15, entry_len(entry));
+    TEST_ASSERT_EQUAL_STRING("fifteen chars!!", entry_key(entry));
+
+    entry = &map->entries[find(map, "sixteen chars!!!", 16, map->hash("sixteen chars!!!", 16))];
+    TEST_ASSERT_EQUAL_INT(LONG_KEY, entry->key.in[15]);
+    TEST_ASSERT_EQUAL_INT(16, entry_len(entry));
+    TEST_ASSERT_EQUAL_STRING("sixteen chars!!!", entry_key(entry));
+
+    /* a shorter or longer prefix of an inline key is another key */
+    status = map_get(map, "fifteen chars!", &res);
+    TEST_ASSERT_EQUAL_INT(MAP_ENOENTRY, status);
+    status = map_get_n(map, "nul\0inside", 4, &res);
+    TEST_ASSERT_EQUAL_INT(MAP_ENOENTRY, status);
+
+    status = map_get(map, "", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(1, (int)res);
+
+    status = map_get_n(map, "nul\0inside", 10, &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(4, (int)res);
+
+    map->pos = find(map, "fifteen chars!!", 15, map->hash("fifteen chars!!", 15));
+    map_cur(map, key, &res);
+    TEST_ASSERT_EQUAL_STRING("fifteen chars!!", key);
+    TEST_ASSERT_EQUAL_INT(2, (int)res);
+
+    map_del(map, "sixteen chars!!!");
+    TEST_ASSERT_EQUAL_INT(0, map->keys.live);
+
+    map_free(map);
+}
+
+/****************
+ * check_update *
+ ****************/
+
+static uintptr_t freed_vals[4];
+static int nfreed;
+
+static void
+count_free(void* val)
+{
+    freed_vals[nfreed++] = (uintptr_t)val;
+}
+
+/* updates free the old value and leave the key storage alone */
+
+void
+check_update()
+{
+    struct hashmap* map;
+    struct entry* entry;
+    const char* key;
+    uintptr_t res;
+    int status;
+
+    nfreed = 0;
+    map = map_alloc(13, count_free);
+
+    map_put(map, "brian.kernighan@bell", 1);
+    entry = &map->entries[find(map, "brian.kernighan@bell", 20, 
+                               map->hash("brian.kernighan@bell", 20))];
+    key = entry_key(entry);
+
+    map_put(map, "brian.kernighan@bell", 2);
+    status = map_set(map, "brian.kernighan@bell", 3);
+    TEST_ASSERT_EQUAL_INT(0, status);
+
+    TEST_ASSERT_EQUAL_INT(2, nfreed);
+    TEST_ASSERT_EQUAL_INT(1, (int)freed_vals[0]);
+    TEST_ASSERT_EQUAL_INT(2, (int)freed_vals[1]);
+    TEST_ASSERT_TRUE(key == entry_key(entry));
+    TEST_ASSERT_EQUAL_INT(1, map->len);
+
+    status = map_get(map, "brian.kernighan@bell", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(3, (int)res);
+
+    map_free(map);
+    TEST_ASSERT_EQUAL_INT(3, nfreed);
+    TEST_ASSERT_EQUAL_INT(3, (int)freed_vals[2]);
+}
+
+/****************
+ * check_upsert *
+ ****************/
+
+/* counting words in place, across grows, and with incremental rehashing */
+
+void
+check_upsert()
+{
+    static const int flags[] = { 0, MAP_POW2, MAP_INCREMENTAL };
+    struct hashmap *map, *other;
+    char key[16];
+    uintptr_t* val;
+    uintptr_t res;
+    int inserted, status;
+
+    for (int f = 0; f < 3; f++) {
+        map = map_alloc_ex(5, 0, 0, flags[f]);
+
+        for (int i = 0; i < 3000; i++) {
+            sprintf(key, "word:%d", i % 1000);
+            val = map_upsert(map, key, &inserted);
+            TEST_ASSERT_EQUAL_INT(i < 1000, inserted);
+            TEST_ASSERT_EQUAL_INT(i < 1000 ? 0 : i / 1000, (int)*val);
+            (*val)++;
+        }
+
+        TEST_ASSERT_EQUAL_INT(1000, count(map));
+
+        for (int i = 0; i < 1000; i++) {
+            sprintf(key, "word:%d", i);
+            status = map_get(map, key, &res);
+            TEST_ASSERT_EQUAL_INT(0, status);
+            TEST_ASSERT_EQUAL_INT(3, (int)res);
+        }
+
+        val = map_upsert_n(map, "word:7", 6, 0);
+        TEST_ASSERT_EQUAL_INT(3, (int)*val);
+
+        map_free(map);
+    }
+
+    /* picking the probe up where the lookup stopped lays out the same table */
+    map = map_alloc(2000, 0);
+    other = map_alloc(2000, 0);
+
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "word:%d", i);
+        *map_upsert(map, key, 0) = i;
+        map_put(other, key, i);
+    }
+
+    TEST_ASSERT_EQUAL_INT(other->cap, map->cap);
+    TEST_ASSERT_EQUAL_INT(other->cost, map->cost);
+    TEST_ASSERT_EQUAL_INT(other->maxpsl, map->maxpsl);
+    TEST_ASSERT_EQUAL_MEMORY(other->psls, map->psls, map->cap + PSL_MAX);
+    TEST_ASSERT_EQUAL_MEMORY(other->tags, map->tags, map->cap + PSL_MAX);
+
+    map_free(map);
+    map_free(other);
+}
+
+/****************
+ * check_hash_h *
+ ****************/
+
+/* one hash serves every map built with the same hash function */
+
+void
+check_hash_h()
+{
+    struct hashmap *cache, *store;
+    uintptr_t res;
+    uint64_t h;
+    int status;
+
+    cache = map_alloc(5, 0);
+    store = map_alloc_ex(5, 0, 0, MAP_POW2);
+
+    h = map_hash(cache, "dennis", 6);
+    TEST_ASSERT_TRUE(h == map_hash_wyhash("dennis", 6));
+    TEST_ASSERT_TRUE(h == map_hash(store, "dennis", 6));
+
+    map_put_h(store, "dennis", 6, h, 2);
+
+    status = map_get_h(cache, "dennis", 6, h, &res);
+    TEST_ASSERT_EQUAL_INT(MAP_ENOENTRY, status);
+
+    status = map_get_h(store, "dennis", 6, h, &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(2, (int)res);
+
+    status = map_set_h(store, "dennis", 6, h, 3);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    status = map_get(store, "dennis", &res);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(3, (int)res);
+
+    status = map_del_h(cache, "dennis", 6, h);
+    TEST_ASSERT_EQUAL_INT(MAP_ENOENTRY, status);
+    status = map_del_h(store, "dennis", 6, h);
+    TEST_ASSERT_EQUAL_INT(0, status);
+    TEST_ASSERT_EQUAL_INT(0, store->len);
+
+    map_free(cache);
+    map_free(store);
+}
+
+/*******************
+ * check_get_batch *
+ *******************/
+
+void
+check_get_batch()
+{
+    struct hashmap* map;
+    char* keys[100];
+    uintptr_t results[100];
+    int found[100];
+    int hits;
+
+    map = map_alloc_ex(5, 0, 0, MAP_INCREMENTAL);
+
+    for (int i = 0; i < 100; i++) {
+        keys[i] = malloc(16);
+        sprintf(keys[i], "user:%06d", i);
+        if (i % 2 == 0)
+            map_put(map, keys[i], i);
+    }
+
+    /* more than one batch, some keys still in the old table */
+    hits = map_get_batch(map, keys, 100, results, found);
+    TEST_ASSERT_EQUAL_INT(50, hits);
+
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_EQUAL_INT(i % 2 == 0, found[i]);
+        if (found[i])
+            TEST_ASSERT_EQUAL_INT(i, (int)results[i]);
+    }
+
+    TEST_ASSERT_EQUAL_INT(0, map_get_batch(map, keys, 0, results, found));
+
+    map_free(map);
+
+    for (int i = 0; i < 100; i++)
+        free(keys[i]);
+}
+
+/***************
+ * check_batch *
+ ***************/
+
+void
+check_batch()
+{
+    static const int flags[] = { 0, MAP_POW2, MAP_INCREMENTAL };
+    struct hashmap* map;
+    char* keys[1000];
+    char key[16];
+    uintptr_t vals[1000];
+    uintptr_t res;
+    int deleted, status, cap;
+
+    for (int i = 0; i < 1000; i++) {
+        keys[i] = malloc(16);
+        sprintf(keys[i], "user:%06d", i);
+        vals[i] = i;
+    }
+
+    for (int f = 0; f < 3; f++) {
+        map = map_alloc_ex(5, 0, 0, flags[f]);
+
+        map_put_batch(map, keys, vals, 600);
+
+        /* 200 new keys, 200 updates */
+        vals[500] = 7;
+        map_put_batch(map, keys + 400, vals + 400, 400);
+        vals[500] = 500;
+
+        TEST_ASSERT_EQUAL_INT(800, count(map));
+
+        for (int i = 0; i < 1000; i++) {
+            status = map_get(map, keys[i], &res);
+            TEST_ASSERT_EQUAL_INT(i < 800 ? 0 : MAP_ENOENTRY, status);
+            if (i < 800)
+                TEST_ASSERT_EQUAL_INT(i == 500 ? 7 : i, (int)res);
+        }
+
+        /* 700 of these are in the map */
+        deleted = map_del_batch(map, keys + 100, 900);
+        TEST_ASSERT_EQUAL_INT(700, deleted);
+        TEST_ASSERT_EQUAL_INT(100, count(map));
+
+        /* shrunk once, straight past several halvings */
+        TEST_ASSERT_TRUE(count(map) > map->cap / 4);
+
+        for (int i = 0; i < 1000; i++) {
+            status = map_get(map, keys[i], &res);
+            TEST_ASSERT_EQUAL_INT(i < 100 ? 0 : MAP_ENOENTRY, status);
+        }
+
+        map_free(map);
+    }
+
+    /* a batch of updates makes no room, so a delete has nothing to shrink */
+    for (int f = 0; f < 3; f++) {
+        map = map_alloc_ex(5, 0, 0, flags[f]);
+        map_put_batch(map, keys, vals, 1000);
+        cap = map->cap;
+
+        map_put_batch(map, keys, vals, 1000);
+        TEST_ASSERT_EQUAL_INT(cap, map->cap);
+        TEST_ASSERT_EQUAL_INT(1000, count(map));
+
+        map_del(map, keys[0]);
+        TEST_ASSERT_EQUAL_INT(cap, map->cap);
+
+        map_free(map);
+    }
+
+    /* a batch that outgrows an incremental map leaves the move to later ops */
+    map = map_alloc_ex(5, 0, 0, MAP_INCREMENTAL);
+
+    for (int i = 0; i < 1000 || map->old || cap_for(count(map) + 64) <= map->cap; i++) {
+        sprintf(key, "fill:%06d", i);
+        map_put(map, key, i);
+    }
+
+    map_put_batch(map, keys, vals, 64);
+    TEST_ASSERT_NOT_NULL(map->old);
+
+    for (int i = 0; i < 64; i++) {
+        status = map_get(map, keys[i], &res);
+        TEST_ASSERT_EQUAL_INT(0, status);
+        TEST_ASSERT_EQUAL_INT(i, (int)res);
+    }
+
+    map_free(map);
+
+    for (int i = 0; i < 1000; i++)
+        free(keys[i]);
+}
+
+/*****************
+ * check_iterate *
+ *****************/
+
+/* the loop from map.h visits every entry once, in both tables while rehashing */
+
+void
+check_iterate()
+{
+    struct hashmap* map;
+    char key[16];
+    uintptr_t val;
+    int seen[1000] = { 0 };
+    int n, len;
+
+    map = map_alloc_ex(5, 0, 0, MAP_INCREMENTAL);
+
+    /* stop right after a grow, with entries left in old */
+    for (len = 0; len < 100 || map->old == 0; len++) {
+        sprintf(key, "user:%06d", len);
+        map_put(map, key, len);
+    }
+
+    TEST_ASSERT_TRUE(map->old->len > 0);
+
+    n = 0;
+    map_begin(map); 
+    while (!map_end(map)) {
+        map_cur(map, key, &val);
+        TEST_ASSERT_EQUAL_INT(0, strncmp(key, "user:", 5));
+        seen[val]++;
+        n++;
+        map_next(map);
+    }
+
+    TEST_ASSERT_EQUAL_INT(len, n);
+    for (int i = 0; i < len; i++)
+        TEST_ASSERT_EQUAL_INT(1, seen[i]);
+
+    /* stays at the end */
+    map_next(map);
+    TEST_ASSERT_TRUE(map_end(map));
+
+    map_free(map);
+
+    map = map_alloc(5, 0);
+    map_begin(map);
+    TEST_ASSERT_TRUE(map_end(map));
+    map_free(map);
+}
+
+/***************
+ * check_stats *
+ ***************/
+
+void
+check_stats()
+{
+    struct hashmap* map;
+    struct map_stats stats;
+    char key[32];
+    uintptr_t res;
+    int total, longest, top;
+
+    map = map_alloc(5, 0);
+
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, i % 2 ? "user:%06d" : "session:user:%06d", i);
+        map_put(map, key, i);
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, i % 2 ? "user:%06d" : "session:user:%06d", i);
+        map_get(map, key, &res);
+    }
+
+    map_stats(map, &stats);
+
+    TEST_ASSERT_EQUAL_INT(1000, stats.len);
+    TEST_ASSERT_EQUAL_INT(map->cap, stats.cap);
+    TEST_ASSERT_TRUE(stats.load > 0.25 && stats.load < 0.75);
+    TEST_ASSERT_EQUAL_INT(map->cost, (int)(stats.mean_psl * 1000 + 0.5));
+
+    /* the longest probe in the table, not the maxpsl bound */
+    longest = 0;
+    for (int i = 0; i < map->cap + PSL_MAX; i++)
+        if (map->psls[i] && map->psls[i] - 1 > longest)
+            longest = map->psls[i] - 1;
+    TEST_ASSERT_EQUAL_INT(longest, stats.max_psl);
+
+    total = 0;
+    top = 0;
+    for (int i = 0; i < MAP_HIST; i++) {
+        total += stats.psl_hist[i];
+        if (stats.psl_hist[i])
+            top = i;
+    }
+    TEST_ASSERT_EQUAL_INT(1000, total);
+
+    /* and it falls in the last bucket of the histogram, 2^(top - 1) and up */
+    TEST_ASSERT_TRUE(top == 0 ? longest == 0 : longest >> (top - 1) == 1);
+
+    /* values are inside the entries, not on top of them */
+    TEST_ASSERT_EQUAL_INT(1000 * sizeof(uintptr_t), stats.value_bytes);
+    TEST_ASSERT_EQUAL_INT((map->cap + PSL_MAX) * sizeof(struct entry), 
+                          stats.entry_bytes + stats.value_bytes);
+    TEST_ASSERT_TRUE(stats.key_bytes >= 500 * RECORD(19));
+
+    /* psls, tags and the occupancy bitmap */
+    TEST_ASSERT_EQUAL_INT(sizeof(struct hashmap) + 2 * (map->cap + PSL_MAX + GROUP)
+                          + WORDS(map->cap + PSL_MAX) * sizeof(uint64_t), 
+                          stats.table_bytes);
+
+    /* grew from 5, every get hit after one compare */
+    TEST_ASSERT_TRUE(stats.resizes >= 5);
+    TEST_ASSERT_TRUE(stats.probes >= 2000);
+    TEST_ASSERT_TRUE(stats.compares >= 1000);
+    TEST_ASSERT_EQUAL_INT(0, stats.backshifts);
+
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, i % 2 ? "user:%06d" : "session:user:%06d", i);
+        map_del(map, key);
+    }
+
+    map_stats(map, &stats);
+    TEST_ASSERT_EQUAL_INT(0, stats.len);
+    TEST_ASSERT_TRUE(stats.mean_psl == 0);
+    TEST_ASSERT_TRUE(stats.backshifts > 0);
+
+    map_free(map);
+}
+
+/*******************
+ * check_iter_nest *
+ *******************/
+
+/* two iterators at once over a const map, the inner one restarted each time */
+
+void
+check_iter_nest()
+{
+    struct hashmap* map;
+    const struct hashmap* view;
+    struct map_iter outer, inner;
+    char okey[16], ikey[16];
+    uintptr_t oval, ival;
+    int pairs, sum, pos;
+
+    map = map_alloc_ex(5, 0, 0, MAP_INCREMENTAL);
+
+    for (int i = 0; i < 30; i++) {
+        sprintf(okey, "user:%06d", i);
+        map_put(map, okey, i);
+    }
+
+    view = map;
+    pos = map->pos;
+    pairs = 0;
+    sum = 0;
+
+    map_iter_init(&outer, view);
+    while (map_iter_next(&outer, okey, &oval)) {
+        map_iter_init(&inner, view);
+        while (map_iter_next(&inner, ikey, &ival)) {
+            TEST_ASSERT_EQUAL_INT(0, strncmp(ikey, "user:", 5));
+            pairs++;
+        }
+        sum += oval;
+    }
+
+    TEST_ASSERT_EQUAL_INT(30 * 30, pairs);
+    TEST_ASSERT_EQUAL_INT(29 * 30 / 2, sum);
+
+    /* done stays done, and the map's own cursor was not touched */
+    TEST_ASSERT_EQUAL_INT(0, map_iter_next(&outer, okey, &oval));
+    TEST_ASSERT_EQUAL_INT(pos, map->pos);
+
+    map_free(map);
+}
+
+/******************
+ * check_iter_ref *
+ ******************/
+
+/* keys and values are handed out in place, both short and long keys */
+
+void
+check_iter_ref()
+{
+    struct hashmap* map;
+    struct map_iter it;
+    const char* key;
+    size_t len;
+    uintptr_t* val;
+    uintptr_t res;
+    int n;
+
+    map = map_alloc(13, 0);
+
+    map_put(map, "brian", 1);
+    map_put(map, "brian.kernighan@bell", 2);
+    map_put_n(map, "nul\0inside", 10, 3);
+
+    n = 0;
+    map_iter_init(&it, map);
+    while (map_iter_next_ref(&it, &key, &len, &val)) {
+        TEST_ASSERT_EQUAL_INT(0, key[len]);
+        TEST_ASSERT_TRUE(key == entry_key(&map->entries[it.pos - 1]));
+
+        if (*val == 1)
+            TEST_ASSERT_EQUAL_STRING("brian", key);
+        else if (*val == 2)
+            TEST_ASSERT_EQUAL_INT(20, len);
+        else
+            TEST_ASSERT_EQUAL_INT(0, memcmp(key, "nul\0inside", 10));
+
+        /* values can be changed through the pointer */
+        *val += 10;
+        n++;
+    }
+
+    TEST_ASSERT_EQUAL_INT(3, n);
+
+    map_get(map, "brian.kernighan@bell", &res);
+    TEST_ASSERT_EQUAL_INT(12, (int)res);
+
+    map_begin(map);
+    map_cur_ref(map, &key, &len, &val);
+    TEST_ASSERT_TRUE(strlen(key) == len || len == 10);
+    TEST_ASSERT_TRUE(*val > 10);
+
+    map_free(map);
+}
+
+/**************
+ * check_used *
+ **************/
+
+/* the occupancy bitmap tracks the psls through puts, dels and back-shifts */
+
+void
+check_used()
+{
+    struct hashmap* map;
+    char key[16];
+    int n;
+
+    map = map_alloc(1543, 0);
+
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "user:%06d", i);
+        map_put(map, key, i);
+    }
+
+    /* sparse, but just above where shrink starts */
+    for (int i = 0; i < 1000; i++) {
+        if (i % 5 < 2)
+            continue;
+        sprintf(key, "user:%06d", i);
+        map_del(map, key);
+    }
+
+    TEST_ASSERT_EQUAL_INT(1543, map->cap);
+
+    for (int i = 0; i < map->cap + PSL_MAX; i++)
+        TEST_ASSERT_EQUAL_INT(map->psls[i] != 0, (map->used[i >> 6] >> (i & 63)) & 1);
+
+    n = 0;
+    for (int i = used(map, 0); i < map->cap + PSL_MAX; i = used(map, i + 1)) {
+        TEST_ASSERT_TRUE(map->psls[i] != 0);
+        n++;
+    }
+
+    TEST_ASSERT_EQUAL_INT(400, n);
+    TEST_ASSERT_EQUAL_INT(map->cap + PSL_MAX, used(map, map->cap + PSL_MAX));
+
+    map_free(map);
+}
+
+/****************
+ * check_ranges *
+ ****************/
+
+static int
+add_val(const char* key, uintptr_t* val, void* ctx)
+{
+    (void)key;
+    *(int*)ctx += *val;
+    return 0;
+}
+
+static int
+find_val(const char* key, uintptr_t* val, void* ctx)
+{
+    (void)val;
+    return strcmp(key, ctx) == 0 ? 7 : 0;
+}
+
+/* any split of the slots, across both tables, visits each entry once */
+
+void
+check_ranges()
+{
+    struct hashmap* map;
+    char key[16];
+    int bounds[9];
+    int sum, len, total;
+
+    map = map_alloc_ex(5, 0, 0, MAP_INCREMENTAL);
+
+    /* stop right after a grow, with entries left in old */
+    for (len = 0; len < 300 || map->old == 0; len++) {
+        sprintf(key, "user:%06d", len);
+        map_put(map, key, len);
+    }
+
+    TEST_ASSERT_TRUE(map->old->len > 0);
+    total = len * (len - 1) / 2;
+
+    for (int n = 1; n <= 8; n++) {
+        map_split(map, n, bounds);
+        TEST_ASSERT_EQUAL_INT(0, bounds[0]);
+        TEST_ASSERT_EQUAL_INT(map_slots(map), bounds[n]);
+
+        sum = 0;
+        for (int i = 0; i < n; i++) {
+            TEST_ASSERT_TRUE(bounds[i] <= bounds[i + 1]);
+            map_for_each_range(map, bounds[i], bounds[i + 1], add_val, &sum);
+        }
+
+        TEST_ASSERT_EQUAL_INT(total, sum);
+    }
+
+    /* early exit hands back what fn returned */
+    TEST_ASSERT_EQUAL_INT(7, map_for_each_range(map, 0, map_slots(map), find_val, "user:000003"));
+    TEST_ASSERT_EQUAL_INT(0, map_for_each_range(map, 0, map_slots(map), find_val, "nobody"));
+
+    map_free(map);
+}
+
+/*****************
+ * check_foreach *
+ *****************/
+
+void
+check_foreach()
+{
+    struct hashmap* map;
+    const char* key;
+    size_t len;
+    uintptr_t* val;
+    char buf[16];
+    int sum, n;
+
+    map = map_alloc(5, 0);
+
+    for (int i = 0; i < 100; i++) {
+        sprintf(buf, "user:%06d", i);
+        map_put(map, buf, i);
+    }
+
+    sum = 0;
+    TEST_ASSERT_EQUAL_INT(0, map_foreach(map, add_val, &sum));
+    TEST_ASSERT_EQUAL_INT(99 * 100 / 2, sum);
+    TEST_ASSERT_EQUAL_INT(7, map_foreach(map, find_val, "user:000042"));
+
+    sum = 0;
+    n = 0;
+    MAP_FOREACH(map, key, len, val) {
+        TEST_ASSERT_EQUAL_INT(11, len);
+        TEST_ASSERT_EQUAL_INT(0, strncmp(key, "user:", 5));
+        sum += *val;
+        n++;
+    }
+
+    TEST_ASSERT_EQUAL_INT(100, n);
+    TEST_ASSERT_EQUAL_INT(99 * 100 / 2, sum);
+
+    /* break leaves early */
+    n = 0;
+    MAP_FOREACH(map, key, len, val) {
+        if (++n == 10)
+            break;
+    }
+
+    TEST_ASSERT_EQUAL_INT(10, n);
+
+    map_free(map);
+}
+
+/*****************
+ * check_collide *
+ *****************/
+
+/* all keys hash the same */
+
+uint64_t
+same_hash(const void* key, size_t len)
+{
+    (void)key;
+    (void)len;
+    return 42;
+}
+
+/* "c" keys share home 42, the rest of the keys sit two slots apart after it */
+
+uint64_t
+spaced_hash(const void* key, size_t len)
+{
+    const char* s = key;
+    uint64_t n = 0;
+
+    for (size_t i = 1; i < len; i++)
+        n = 10 * n + s[i] - '0';
+
+    return s[0] == 'c' ? 42 : 42 + 2 * n;
+}
+
+/* keys sharing a full hash stop at PSL_MAX instead of growing the map forever */
+
+void
+check_collide()
+{
+    struct hashmap* map;
+    char key[17], *keys[PSL_MAX + 8];
+    uintptr_t vals[PSL_MAX + 8], val;
+    int status;
+
+    /* "Ab" and "BA" hash the same under djb2, so do all 256 mixes of 8 */
+    map = map_alloc_ex(16, 0, map_hash_djb2, 0);
+
+    for (int i = 0; i < 256; i++) {
+        for (int j = 0; j < 8; j++)
+            memcpy(key + 2 * j, i >> j & 1 ? "Ab" : "BA", 2);
+        key[16] = 0;
+
+        status = map_put(map, key, i);
+        TEST_ASSERT_EQUAL_INT(i < PSL_MAX ? 0 : MAP_ECOLLIDE, status);
+    }
+
+    TEST_ASSERT_EQUAL_INT(PSL_MAX, map->len);
+    TEST_ASSERT_TRUE(map->cap < 4096);
+
+    for (int i = 0; i < 256; i++) {
+        for (int j = 0; j < 8; j++)
+            memcpy(key + 2 * j, i >> j & 1 ? "Ab" : "BA", 2);
+
+        status = map_get(map, key, &val);
+        TEST_ASSERT_EQUAL_INT(i < PSL_MAX ? 0 : MAP_ENOENTRY, status);
+        if (status == 0)
+            TEST_ASSERT_EQUAL_INT(i, val);
+    }
+
+    /* a key already in the map still updates */
+    TEST_ASSERT_EQUAL_INT(0, map_put(map, "BABABABABABABABA", 7));
+    map_get(map, "BABABABABABABABA", &val);
+    TEST_ASSERT_EQUAL_INT(7, val);
+
+    map_free(map);
+
+    /* the colliding run is swapped in ahead of the others, maxpsl follows it */
+    map = map_alloc_ex(1000, 0, spaced_hash, 0);
+
+    for (int i = 1; i <= 150; i++) {
+        sprintf(key, "o%d", i);
+        TEST_ASSERT_EQUAL_INT(0, map_put(map, key, i));
+    }
+
+    for (int i = 0; i < 200; i++) {
+        sprintf(key, "c%d", i);
+        TEST_ASSERT_EQUAL_INT(i < PSL_MAX ? 0 : MAP_ECOLLIDE, map_put(map, key, i));
+    }
+
+    TEST_ASSERT_EQUAL_INT(150 + PSL_MAX, map->len);
+    TEST_ASSERT_EQUAL_INT(PSL_MAX - 1, map->maxpsl);
+
+    for (int i = 1; i <= 150; i++) {
+        sprintf(key, "o%d", i);
+        TEST_ASSERT_EQUAL_INT(0, map_get(map, key, &val));
+        TEST_ASSERT_EQUAL_INT(i, val);
+    }
+
+    map_free(map);
+
+    /* a rehash starts with the colliding run in old, new keys go to the other table */
+    map = map_alloc_ex(169, 0, same_hash, MAP_INCREMENTAL);
+
+    for (int i = 0; i < 140; i++) {
+        sprintf(key, "key%d", i);
+        status = map_put(map, key, i);
+        TEST_ASSERT_EQUAL_INT(i < PSL_MAX ? 0 : MAP_ECOLLIDE, status);
+        if (i == PSL_MAX - 2)
+            TEST_ASSERT_NOT_NULL(map->old);
+    }
+
+    for (int i = 0; i < 140; i++) {
+        sprintf(key, "key%d", i);
+        TEST_ASSERT_EQUAL_INT(i < PSL_MAX ? 0 : MAP_ENOENTRY, map_get(map, key, &val));
+    }
+
+    /* moving whatever is left of old keeps every key */
+    for (int i = 0; i < 200; i++)
+        map_del(map, "missing");
+
+    TEST_ASSERT_NULL(map->old);
+    TEST_ASSERT_EQUAL_INT(PSL_MAX, map->len);
+
+    map_free(map);
+
+    /* a constant hash, through every insertion path */
+    map = map_alloc_ex(16, 0, same_hash, MAP_INCREMENTAL);
+
+    for (int i = 0; i < PSL_MAX; i++) {
+        sprintf(key, "key%d", i);
+        TEST_ASSERT_EQUAL_INT(0, map_put(map, key, i));
+    }
+
+    TEST_ASSERT_EQUAL_INT(MAP_ECOLLIDE, map_put(map, "one", 1));
+    TEST_ASSERT_NULL(map_upsert(map, "two", 0));
+
+    for (int i = 0; i < PSL_MAX + 8; i++) {
+        keys[i] = malloc(16);
+        sprintf(keys[i], "batch%d", i);
+        vals[i] = i;
+    }
+
+    TEST_ASSERT_EQUAL_INT(MAP_ECOLLIDE, map_put_batch(map, keys, vals, 8));
+    TEST_ASSERT_EQUAL_INT(PSL_MAX, map->len + (map->old ? map->old->len : 0));
+
+    /* room again once one leaves */
+    TEST_ASSERT_EQUAL_INT(0, map_del(map, "key0"));
+    TEST_ASSERT_EQUAL_INT(0, map_put(map, "one", 1));
+
+    map_free(map);
+
+    map = map_alloc_ex(16, 0, same_hash, 0);
+    TEST_ASSERT_EQUAL_INT(MAP_ECOLLIDE, map_build(map, keys, vals, PSL_MAX + 8));
+    TEST_ASSERT_EQUAL_INT(PSL_MAX, map->len);
+    map_free(map);
+
+    for (int i = 0; i < PSL_MAX + 8; i++)
+        free(keys[i]);
+}
+
 /*********************************************************************
  *                                                                   *
  *                              main                                 *
@@ -833,16 +2333,45 @@ main()
     UNITY_BEGIN();
     RUN_TEST(basic);
     RUN_TEST(basic_put);
+    RUN_TEST(basic_put_n);
     RUN_TEST(basic_probe);
     RUN_TEST(basic_del);
     RUN_TEST(basic_grow);
     RUN_TEST(basic_shrink);
+    RUN_TEST(basic_pow2);
+    RUN_TEST(basic_incremental);
+    RUN_TEST(basic_build);
 
     RUN_TEST(check_tree_values);
     RUN_TEST(check_is_prime);
     RUN_TEST(check_next_prime);
+    RUN_TEST(check_prime_table);
+    RUN_TEST(check_shrink_prime);
+    RUN_TEST(check_hash);
     RUN_TEST(check_probe);
     RUN_TEST(check_del);
+    RUN_TEST(check_early_exit);
+    RUN_TEST(check_group_probe);
+    RUN_TEST(check_many);
+    RUN_TEST(check_many_pow2);
+    RUN_TEST(check_many_incremental);
+    RUN_TEST(check_build);
+    RUN_TEST(check_compact);
+    RUN_TEST(check_recycle);
+    RUN_TEST(check_inline);
+    RUN_TEST(check_update);
+    RUN_TEST(check_upsert);
+    RUN_TEST(check_hash_h);
+    RUN_TEST(check_get_batch);
+    RUN_TEST(check_batch);
+    RUN_TEST(check_iterate);
+    RUN_TEST(check_stats);
+    RUN_TEST(check_iter_nest);
+    RUN_TEST(check_iter_ref);
+    RUN_TEST(check_used);
+    RUN_TEST(check_ranges);
+    RUN_TEST(check_foreach);
+    RUN_TEST(check_collide);
 
     return UNITY_END();
 }